@@ -56,5 +56,10 @@ void          FLASH_ByteWrite (FLADDR addr, uint8_t byte);
 uint8_t       FLASH_ByteRead  (FLADDR addr);
 void          FLASH_PageErase (FLADDR addr);
 
+// Block routines, setting up the VDD monitor once per block
+void          FLASH_BlockWrite (FLADDR dest, uint8_t *src, uint16_t numbytes);
+void          FLASH_BlockRead  (uint8_t *dest, FLADDR src, uint16_t numbytes);
+void          FLASH_BlockCopy  (FLADDR dest, FLADDR src, uint16_t numbytes);
+
 
 #endif    // _EFM8BB1_FLASHPRIMITIVES_H_
@@ -41,5 +41,12 @@ void FLASH_Copy (FLADDR dest, FLADDR src, uint16_t numbytes);
 // Flash test routines
 void FLASH_Fill (FLADDR addr, uint32_t length, uint8_t fill);
 
+// Flash diff routines
+bool FLASH_Compare (FLADDR addr, uint8_t *src, uint16_t numbytes);
+bool FLASH_Programmable (FLADDR dest, uint8_t *src, uint16_t numbytes);
+bool FLASH_Blank (FLADDR addr, uint16_t numbytes);
+void FLASH_WriteDiff (FLADDR dest, uint8_t *src, uint16_t numbytes);
+void FLASH_UpdateDiff (FLADDR dest, uint8_t *src, uint16_t numbytes);
+
 
 #endif    // _EFM8UB1_FLASHUTILS_H_
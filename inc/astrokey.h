@@ -48,8 +48,17 @@ SI_VARIABLE_SEGMENT_POINTER(UUID, static const uint8_t, SI_SEG_CODE) = UUID_ADDR
 ///////////////////////////
 
 // wIndex values
-#define ASTROKEY_SET_WORKFLOW 0x01
-#define ASTROKEY_GET_WORKFLOW 0x02
+#define ASTROKEY_SET_WORKFLOW      0x01
+#define ASTROKEY_GET_WORKFLOW      0x02
+#define ASTROKEY_SET_POLICY        0x03
+#define ASTROKEY_GET_POLICY        0x04
+#define ASTROKEY_SET_DEBOUNCE      0x05
+#define ASTROKEY_GET_DEBOUNCE      0x06
+#define ASTROKEY_GET_SAVE_STATUS   0x07
+#define ASTROKEY_GET_UPLOAD_FENCE  0x08
+#define ASTROKEY_GET_WORKFLOW_CRCS 0x09
+#define ASTROKEY_BATCH             0x0A
+#define ASTROKEY_GET_STREAM        0x0B
 
 ///////////////////////
 // Device Parameters //
@@ -66,6 +75,13 @@ SI_VARIABLE_SEGMENT_POINTER(UUID, static const uint8_t, SI_SEG_CODE) = UUID_ADDR
 // Switch pressed
 #define PRESSED(x) (!x)
 
+// Bits of P0 read by the switches, bit n is switch n
+#define SWITCH_MASK 0x1F
+// Mask of the switches currently pressed, switches pull their pin low
+#define SWITCHES_PRESSED() (~P0 & SWITCH_MASK)
+// Holding these switches together resets the device
+#define RESET_SWITCHES 0x11
+
 ////////////////////////
 // Workflow Constants //
 ////////////////////////
@@ -74,60 +90,212 @@ SI_VARIABLE_SEGMENT_POINTER(UUID, static const uint8_t, SI_SEG_CODE) = UUID_ADDR
 #define NO_WORKFLOW 0xFF
 
 // Workflow action types
+// Workflows are a byte stream of variable length actions, the first byte of each
+// action selects its type and length.
+
+// End of the workflow (1 byte)
+#define WORKFLOW_ACTION_END   0
+// Press, release, or press and release the usage in the next byte (2 bytes)
 #define WORKFLOW_ACTION_DOWN  1
 #define WORKFLOW_ACTION_UP    2
 #define WORKFLOW_ACTION_PRESS 3
+// Delay for the next byte * 10 ms (2 bytes)
 #define WORKFLOW_ACTION_DELAY 16
-#define WORKFLOW_ACTION_PAUSE 128 // Pauses a macro until key release
+// Delay for the next 2 bytes ms, little endian (3 bytes)
+#define WORKFLOW_ACTION_DELAY_MS 17
+// Runs the following action the number of times in the next byte (2 bytes)
+#define WORKFLOW_ACTION_REPEAT 32
+// Types the number of ASCII characters in the next byte, followed by the
+// characters themselves (2 bytes + 1 byte per character)
+#define WORKFLOW_ACTION_STRING 33
+// Press and release of usage (action & 0x3F) (1 byte, 0x40 - 0x7F)
+#define WORKFLOW_ACTION_TAP      0x40
+#define WORKFLOW_ACTION_TAP_MASK 0xC0
+#define WORKFLOW_ACTION_PAUSE 128 // Pauses a macro until key release (2 bytes)
+// Press (0xE0 - 0xE7) or release (0xE8 - 0xEF) of modifier usage
+// USAGE_LEFTCTRL + (action & 0x07) (1 byte)
+#define WORKFLOW_ACTION_MODIFIER      0xE0
+#define WORKFLOW_ACTION_MODIFIER_MASK 0xF0
+#define WORKFLOW_ACTION_MODIFIER_UP   0x08
 #define WORKFLOW_ACTION_UNPROGRAMMED 255 // Unprogrammed flash memory
 
+// Shift flag in the ASCII to usage table
+#define ASCII_SHIFT 0x80
+
 #define USAGE_LEFTCTRL  224
 #define USAGE_LEFTSHIFT 225
 #define USAGE_LEFTALT   226
 #define USAGE_LEFTGUI   227
+#define USAGE_RIGHTGUI  231
 
-#define MODIFIER_LEFTCTRL  0x01
-#define MODIFIER_LEFTSHIFT 0x02
-#define MODIFIER_LEFTALT   0x04
-#define MODIFIER_LEFTGUI   0x08
-
-// Workflow action struct
-typedef struct {
-  uint8_t actionType;
-  uint8_t value;
-} Action_TypeDef;
+// Modifier usages are reported as bit (usage - USAGE_LEFTCTRL) of the modifier byte
+#define IS_MODIFIER(x) ((x) >= USAGE_LEFTCTRL && (x) <= USAGE_RIGHTGUI)
 
 // User data flash
 #define USER_PAGE_SIZE  64
 #define USER_START_ADDR 0xF800
-
-// Number of pages per macro
-#define WORKFLOW_PAGES 2
-// Number of bytes per macro
-#define WORKFLOW_BYTES (WORKFLOW_PAGES * USER_PAGE_SIZE)
-// Maximum number of actions in a macro
-#define WORKFLOW_MAX_SIZE ((WORKFLOW_BYTES) / sizeof(Action_TypeDef))
-// Max number of keys simultaenously held by macro
+// Number of pages of user data flash
+#define USER_NUM_PAGES  16
+#define USER_NUM_BYTES  (USER_NUM_PAGES * USER_PAGE_SIZE)
+#define USER_END_ADDR   (USER_START_ADDR + USER_NUM_BYTES)
+
+// Maximum number of pages per macro
+#define WORKFLOW_MAX_PAGES 4
+// Maximum number of bytes per macro
+#define WORKFLOW_MAX_BYTES (WORKFLOW_MAX_PAGES * USER_PAGE_SIZE)
+// Max number of keys simultaenously held by macro in boot protocol
 #define WORKFLOW_MAX_KEYS 6
-
-#define WORKFLOW_FLASH_ADDR USER_START_ADDR
+// Max number of key state changes coalesced into a single report
+#define WORKFLOW_MAX_FRAME_KEYS (WORKFLOW_MAX_KEYS * 2)
+// Max number of actions run while building a single report
+#define WORKFLOW_MAX_FRAME_ACTIONS 32
+
+// Number of key usages a workflow can hold down, the key bitmap and modifiers
+#define NUM_KEY_USAGES (USAGE_RIGHTGUI + 1)
+// Bytes in a bitmap of held key usages
+#define KEY_USAGE_BYTES ((NUM_KEY_USAGES + 7) / 8)
+
+// Workflow policies, selecting what happens when a switch is pressed while
+// the workflows of other switches are running
+// The workflows run alongside each other
+#define WORKFLOW_POLICY_CONCURRENT 0
+// The other workflows are aborted
+#define WORKFLOW_POLICY_PREEMPT    1
+// The press is ignored
+#define WORKFLOW_POLICY_EXCLUSIVE  2
+#define NUM_WORKFLOW_POLICIES      3
+
+// The runner after the switch runners plays actions streamed by the host,
+// the workflow policies neither stop it nor are held off by it
+#define STREAM_RUNNER NUM_SWITCHES
+#define NUM_RUNNERS   (NUM_SWITCHES + 1)
+
+// Bytes in the ring of streamed actions, a power of two. A streamed action
+// longer than the ring stops the stream until it is reset.
+#define STREAM_RING_SIZE 128
+#define STREAM_RING_MASK (STREAM_RING_SIZE - 1)
+
+// Workflow runner states
+#define RUNNER_IDLE     0 // Finished or never started
+#define RUNNER_RUNNING  1 // Being stepped
+#define RUNNER_PAUSED   2 // Waiting for the switch to be released
+#define RUNNER_ABORTING 3 // Releasing its keys before going idle
+
+// State of the workflow of a switch
+// Flags are bytes as bits cannot be members of a struct
+typedef struct
+{
+  // Flash address of the workflow, read in place and wrapping from the end
+  // of user data flash to its start
+  uint16_t address;
+  // Number of bytes stored for the workflow
+  uint16_t length;
+  // Byte offset of the current action
+  uint16_t offset;
+  uint8_t state;
+  // Whether the switch was released before the next PAUSE was reached
+  uint8_t released;
+  // Whether the key of the current PRESS, tap or character is held down
+  uint8_t pressDown;
+  // Whether shift was pressed for the current character
+  uint8_t pressShift;
+  uint8_t delayStarted;
+  uint32_t delayStartTime;
+  // Index of the next character to type in the current STRING action
+  uint8_t stringIndex;
+  // Number of times left to run the current action, set by a REPEAT action
+  uint8_t repeatCount;
+  // Whether the last key change still has to reach the host
+  uint8_t reportPending;
+  // Count of reports sent once the last key change has reached the host
+  uint8_t pendingReport;
+  // Keys held down by this workflow
+  uint8_t held[KEY_USAGE_BYTES];
+} WorkflowRunner_TypeDef;
+
+// Set to 1 to step workflows from the SOF interrupt, once per frame,
+// instead of from the main loop
+#define WORKFLOW_STEP_IN_SOF 0
+
+#if WORKFLOW_STEP_IN_SOF
+// The main loop must hold off the SOF interrupt while changing workflow state
+#define ENGINE_LOCK()   USB_DisableInts()
+#define ENGINE_UNLOCK() USB_EnableInts()
+#else
+#define ENGINE_LOCK()
+#define ENGINE_UNLOCK()
+#endif
 
 ////////////////////////
-// Workflow Functions //
+// Workflow Variables //
 ////////////////////////
 
-void saveWorkflow(Action_TypeDef* workflowData, uint8_t saveIndex);
-void loadWorkflow(Action_TypeDef* workflowData, uint8_t loadIndex);
+// Buffer for workflows read by the host and for batches on EP0
+extern uint8_t SI_SEG_XDATA tmpWorkflow[WORKFLOW_MAX_BYTES];
+// Set while a transfer on EP0 is using tmpWorkflow
+extern volatile bool bufferOnEP0;
 
-////////////////////////
-// Workflow Variables //
-////////////////////////
+// Uploads waiting to be saved, so the next upload can be received while the
+// last one is written to flash
+#define STAGING_QUEUE_SIZE 2
+#define STAGING_QUEUE_MASK (STAGING_QUEUE_SIZE - 1)
+
+typedef struct {
+  uint8_t index;
+  uint16_t length;
+  uint8_t workflow[WORKFLOW_MAX_BYTES];
+} StagedWorkflow_TypeDef;
+
+extern StagedWorkflow_TypeDef SI_SEG_XDATA stagingQueue[STAGING_QUEUE_SIZE];
+
+// The receiving transport only writes stagingHead and the main loop only
+// writes stagingTail. Both count up and wrap at 256 like the report queue.
+// stagingHead counts uploads received and stagingTail uploads finished.
+extern volatile uint8_t stagingHead;
+extern volatile uint8_t stagingTail;
+// Set while an upload is being received into the slot at stagingHead
+extern volatile bool stagingReceiving;
+
+#define STAGING_QUEUE_FULL() ((uint8_t)(stagingHead - stagingTail) == STAGING_QUEUE_SIZE)
+
+// Upload fence polled by the host. The received count just after an upload
+// is its ticket t. The upload is finished once (int8_t)(completed - t) >= 0,
+// and then failed if bit (completed - t) of failures is set.
+typedef struct {
+  uint8_t received;
+  uint8_t completed;
+  uint8_t failures;
+} UploadFence_TypeDef;
+
+// Bit n is set if the upload finished n uploads ago failed
+extern volatile uint8_t uploadFailures;
+
+// Set while a workflow is being sent to the host straight from flash, which
+// holds off saves until it is sent
+extern volatile bool workflowReading;
+
+// Streamed actions, the stream runner's offset counts the bytes played and
+// streamHead the bytes received. Both wrap at 65536 and the ring slot is the
+// count masked by STREAM_RING_MASK.
+extern uint8_t SI_SEG_XDATA streamRing[STREAM_RING_SIZE];
+extern uint16_t streamHead;
+
+// Stream progress read by the host, both little endian. The host may send
+// STREAM_RING_SIZE - (sent - played) more bytes, so the ring never overflows.
+typedef struct {
+  uint16_t played;
+  uint16_t received;
+} StreamStatus_TypeDef;
 
-extern Action_TypeDef SI_SEG_XDATA workflow[WORKFLOW_MAX_SIZE];
-extern uint8_t workflowNumActions;
+// Bit n is set if runner n needs stepping
+extern volatile uint8_t runningWorkflows;
+#define STREAM_RUNNING() ((runningWorkflows & (1 << STREAM_RUNNER)) != 0)
+extern volatile uint8_t workflowPolicy;
 
-extern Action_TypeDef SI_SEG_XDATA tmpWorkflow[WORKFLOW_MAX_SIZE];
-extern volatile int8_t workflowUpdated;
+// Set by interrupts when the main loop has work to do
+extern volatile bool mainLoopWake;
+// Set by the USB interrupt when the host selects another protocol
+extern volatile bool protocolChanged;
 
 ////////////////////////
 // Astrokey Functions //
@@ -135,5 +303,11 @@ extern volatile int8_t workflowUpdated;
 
 void astrokeyInit();
 void astrokeyPoll();
+void astrokeySleep();
+void stepWorkflow();
+uint16_t streamPlayed();
+uint8_t streamCredits();
+void streamAppend(uint8_t value);
+void streamReset();
 
 #endif /* INC_ASTROKEY_H_ */
@@ -0,0 +1,70 @@
+//-----------------------------------------------------------------------------
+// batch.h
+//-----------------------------------------------------------------------------
+// Copyright 2018 AstroKey
+// https://github.com/AstroKey/astrokey_firmware/blob/master/LICENSE
+//
+// File Description:
+//
+// Declarations for batches of vendor requests carried over EP0.
+//
+
+#ifndef INC_BATCH_H_
+#define INC_BATCH_H_
+
+#include <stdint.h>
+#include <si_toolchain.h>
+
+///////////////////////
+// Batch Protocol    //
+///////////////////////
+
+// The host writes a batch with an ASTROKEY_BATCH OUT request and reads the
+// answers with an ASTROKEY_BATCH IN request, two transfers in place of one
+// per request. The OUT data holds commands, each the wIndex of a vendor
+// request, its wValue and a payload length, both little endian, followed
+// by the payload. Only SET_WORKFLOW commands have a payload.
+//
+// Commands that change settings and uploads are carried out when the batch
+// arrives, queries when the answers are read. Each answer is the command's
+// wIndex and the answer length followed by what the vendor request would
+// send. SET_WORKFLOW is answered with the upload ticket. GET_WORKFLOW
+// answers are cut to fit, and the host reads the rest with an offset.
+// Commands that are refused, or whose vendor request would stall, are
+// answered with the length BATCH_REFUSED and no data. Answers that do not
+// fit are left out, along with the answers after them.
+
+// Most commands in a batch
+#define BATCH_MAX_COMMANDS 16
+
+// Answer length of a refused command
+#define BATCH_REFUSED 0xFF
+
+// Command header, the value and length are little endian
+typedef struct {
+  uint8_t request;
+  uint16_t value;
+  uint16_t length;
+} BatchHeader_TypeDef;
+
+// Answer header
+typedef struct {
+  uint8_t request;
+  uint8_t length;
+} BatchAnswer_TypeDef;
+
+// Command kept until the answers are read, the value is in host order
+typedef struct {
+  uint8_t request;
+  uint8_t refused;
+  uint16_t value;
+} BatchCommand_TypeDef;
+
+///////////////////////
+// Batch Functions   //
+///////////////////////
+
+void batchReceived(uint16_t length);
+uint16_t batchReply();
+
+#endif /* INC_BATCH_H_ */
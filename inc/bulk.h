@@ -0,0 +1,83 @@
+//-----------------------------------------------------------------------------
+// bulk.h
+//-----------------------------------------------------------------------------
+// Copyright 2018 AstroKey
+// https://github.com/AstroKey/astrokey_firmware/blob/master/LICENSE
+//
+// File Description:
+//
+// Declarations for the framed workflow transport on the WebUSB bulk endpoints.
+//
+
+#ifndef INC_BULK_H_
+#define INC_BULK_H_
+
+#include <stdint.h>
+#include <si_toolchain.h>
+
+//////////////////////
+// Bulk Protocol    //
+//////////////////////
+
+// The host writes a batch of frames to the bulk OUT endpoint and reads the
+// answers from the bulk IN endpoint. Frames are answered in order and the
+// answers to a batch end in a short packet, so a batch of any number of
+// frames takes a single round trip. Answers may be sent before the whole
+// batch is written, so the host keeps a read of the IN endpoint pending.
+// Uploads are staged and saved while the next frames are received, so SET
+// frames are answered with the upload ticket. GET and END frames wait until
+// every staged upload is finished, and END is answered with the upload fence.
+// STREAM frames carry actions for the stream runner, taken while the ring
+// has room. They are answered with the stream status once half the ring is
+// free or the stream has stopped, so an empty STREAM frame waits for room.
+// The answer ends the answers like END so the host can send more at once.
+
+// Bytes per bulk packet
+#define BULK_PACKET_SIZE 64
+
+// Frame commands
+#define BULK_CMD_END          0x00 // Ends a batch, answered with the upload fence
+#define BULK_CMD_SET_WORKFLOW 0x01 // Payload is the workflow, answered with the upload ticket
+#define BULK_CMD_GET_WORKFLOW 0x02 // No payload, answered with the workflow
+#define BULK_CMD_STREAM       0x03 // Payload is actions to play, answered with the stream status
+#define BULK_CMD_ERROR        0xFF // Answer to an unknown or invalid frame, whose payload is skipped
+
+// Index of a GET_WORKFLOW frame answered with the workflows of all switches
+#define BULK_ALL_WORKFLOWS 0xFF
+// Index of a STREAM frame that drops the actions not yet played first
+#define BULK_STREAM_APPEND 0x00
+#define BULK_STREAM_RESET  0x01
+
+// Bulk transport steps
+#define BULK_STATE_HEADER  0 // Receiving a frame header
+#define BULK_STATE_CLAIM   1 // Waiting for a free staging slot
+#define BULK_STATE_PAYLOAD 2 // Receiving a workflow into the staging slot
+#define BULK_STATE_SAVE    3 // Waiting for the staged uploads to be saved
+#define BULK_STATE_SKIP    4 // Discarding the payload of an invalid frame
+#define BULK_STATE_LOAD    5 // Loading the next workflow to answer with
+#define BULK_STATE_REPLY   6 // Sending an answer header
+#define BULK_STATE_DATA    7 // Sending an answer payload
+#define BULK_STATE_FLUSH   8 // Ending the answers to a batch
+#define BULK_STATE_STREAM  9 // Receiving actions into the stream ring
+#define BULK_STATE_CREDITS 10 // Waiting for room in the stream ring to answer
+
+// Frame header, the length is little endian and counts the payload bytes
+typedef struct {
+  uint8_t command;
+  uint8_t index;
+  uint16_t length;
+} BulkFrame_TypeDef;
+
+// Set while the bulk transport is using the workflow buffer
+extern volatile bool bulkOwnsBuffer;
+
+///////////////////////
+// Bulk Functions    //
+///////////////////////
+
+void bulkRestart();
+void bulkReceived(uint16_t length);
+void bulkSent();
+void bulkPoll();
+
+#endif /* INC_BULK_H_ */
@@ -37,7 +37,7 @@
 // Enable or disable remote wakeup
 // -----------------------------------------------------------------------------
 // $[Remote Wake-up]
-#define SLAB_USB_REMOTE_WAKEUP_ENABLED         0
+#define SLAB_USB_REMOTE_WAKEUP_ENABLED         1
 // [Remote Wake-up]$
 
 // -----------------------------------------------------------------------------
@@ -55,8 +55,8 @@
 // $[Endpoints Used]
 #define SLAB_USB_EP1IN_USED                    1
 #define SLAB_USB_EP1OUT_USED                   0
-#define SLAB_USB_EP2IN_USED                    0
-#define SLAB_USB_EP2OUT_USED                   0
+#define SLAB_USB_EP2IN_USED                    1
+#define SLAB_USB_EP2OUT_USED                   1
 #define SLAB_USB_EP3IN_USED                    0
 #define SLAB_USB_EP3OUT_USED                   0
 // [Endpoints Used]$
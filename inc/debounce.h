@@ -0,0 +1,69 @@
+//-----------------------------------------------------------------------------
+// debounce.h
+//-----------------------------------------------------------------------------
+// Copyright 2018 AstroKey
+// https://github.com/AstroKey/astrokey_firmware/blob/master/LICENSE
+//
+// File Description:
+//
+// Declarations for switch debouncing.
+//
+
+#ifndef INC_DEBOUNCE_H_
+#define INC_DEBOUNCE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <si_toolchain.h>
+
+// Debounce modes
+// Report the first edge at once, then ignore the switch for the window
+#define DEBOUNCE_EAGER      0
+// Report an edge once the switch has read the same for the window
+#define DEBOUNCE_INTEGRATOR 1
+#define NUM_DEBOUNCE_MODES  2
+
+// Default debounce window in milliseconds
+#define DEBOUNCE_DEFAULT_WINDOW 5
+// Shortest debounce window, the integrator reads every switch as pressed
+// with an empty window
+#define DEBOUNCE_MIN_WINDOW 1
+
+// Number of switch events buffered for the main loop, must be a power of two
+#define SWITCH_QUEUE_SIZE 16
+#define SWITCH_QUEUE_MASK (SWITCH_QUEUE_SIZE - 1)
+
+// Set in SwitchEvent_TypeDef.event for a press, the low bits are the switch
+#define SWITCH_EVENT_PRESSED 0x80
+#define SWITCH_EVENT_INDEX   0x0F
+
+// Debounced edge of a switch
+typedef struct
+{
+  uint8_t event;
+  // Low 16 bits of the millisecond counter when the edge was seen
+  uint16_t time;
+} SwitchEvent_TypeDef;
+
+// Mask of the debounced switches pressed, bit n is switch n
+extern volatile uint8_t debouncedSwitches;
+
+extern volatile uint8_t debounceMode;
+// Debounce window in milliseconds
+extern volatile uint8_t debounceWindow;
+
+// Set when an edge could not be queued, the main loop must rescan
+extern volatile bool switchEventsDropped;
+
+// Switches whose press woke the host from suspend, before the timer
+// was running to debounce them
+extern volatile uint8_t wakeupSwitches;
+
+// The last switch edge handled by the main loop
+extern SwitchEvent_TypeDef SI_SEG_XDATA lastSwitchEvent;
+
+bool setDebounce(uint16_t value);
+void debounceTick(uint16_t time);
+bool popSwitchEvent(SwitchEvent_TypeDef* event);
+
+#endif /* INC_DEBOUNCE_H_ */
@@ -16,5 +16,6 @@
 
 uint32_t getMillis();
 void resetMillis();
+void delayBlocking(uint8_t delay);
 
 #endif /* INC_DELAY_H_ */
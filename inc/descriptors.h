@@ -45,16 +45,43 @@ extern "C"
 // Interface number of the HID keyboard
 #define HID_KEYBOARD_IFC                  1
 
+// Endpoint addresses of the WebUSB interface bulk endpoints
+#define BULK_OUT_EP_ADDR      EP2OUT
+#define BULK_IN_EP_ADDR       EP2IN
+
+// Offset of the HID descriptor in the configuration descriptor
+#define HID_DESC_OFFSET                   41
+
+// HID protocols selected with SET_PROTOCOL
+#define HID_PROTOCOL_BOOT                 0
+#define HID_PROTOCOL_REPORT               1
+
+// Number of keys in the boot protocol key array
+#define BOOT_REPORT_KEYS                  6
+// Size of the boot protocol keyboard report
+#define BOOT_REPORT_SIZE                  (2 + BOOT_REPORT_KEYS)
+// Number of usages covered by the N-key-rollover bitmap (0x00 - 0xDF)
+#define REPORT_BITMAP_USAGES              0xE0
+// Size of the N-key-rollover bitmap
+#define REPORT_BITMAP_SIZE                (REPORT_BITMAP_USAGES / 8)
+
 // Keyboard Report
+// The first 8 bytes are the boot protocol report, the bitmap is only sent
+// in report protocol.
   typedef struct
   {
     uint8_t modifiers;
     uint8_t reserved;
-    uint8_t keys[6];
+    uint8_t keys[BOOT_REPORT_KEYS];
+    uint8_t bitmap[REPORT_BITMAP_SIZE];
   } KeyReport_TypeDef;
 
-  extern volatile KeyReport_TypeDef keyReport;
-  extern volatile bool keyReportSent;
+// Length of the keyboard report in the current protocol
+#define KEY_REPORT_LENGTH() ((keyReportProtocol == HID_PROTOCOL_BOOT) ? \
+                             BOOT_REPORT_SIZE : sizeof(KeyReport_TypeDef))
+
+  extern volatile KeyReport_TypeDef SI_SEG_XDATA keyReport;
+  extern volatile uint8_t keyReportProtocol;
 
 // bRequest number for WebUSB requests
 #define WEBUSB_BREQUEST                   1
@@ -94,7 +121,7 @@ extern "C"
 // Size of entire MS OS 2.0 Descriptor
 #define MS_DS_S htole16(sizeof(MS_OS_20_DescriptorSet_TypeDef))
 
-  extern SI_SEGMENT_VARIABLE(ReportDescriptor0[69], const uint8_t, SI_SEG_CODE);
+  extern SI_SEGMENT_VARIABLE(ReportDescriptor0[75], const uint8_t, SI_SEG_CODE);
   extern SI_SEGMENT_VARIABLE(deviceDesc[], const USB_DeviceDescriptor_TypeDef, SI_SEG_CODE);
   extern SI_SEGMENT_VARIABLE(configDesc[], const uint8_t, SI_SEG_CODE);
   extern SI_SEGMENT_VARIABLE(initstruct, const USBD_Init_TypeDef, SI_SEG_CODE);
@@ -123,6 +150,6 @@ extern SI_SEGMENT_VARIABLE(msDesc, const MS_OS_20_DescriptorSet_TypeDef, SI_SEG_
 
 #endif  // #define __SILICON_LABS_DESCRIPTORS_H__
 // $[HID Report Descriptors]
-extern SI_SEGMENT_VARIABLE(ReportDescriptor0[69], const uint8_t, SI_SEG_CODE);
+extern SI_SEGMENT_VARIABLE(ReportDescriptor0[75], const uint8_t, SI_SEG_CODE);
 // [HID Report Descriptors]$
 
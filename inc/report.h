@@ -0,0 +1,35 @@
+//-----------------------------------------------------------------------------
+// report.h
+//-----------------------------------------------------------------------------
+// Copyright 2018 AstroKey
+// https://github.com/AstroKey/astrokey_firmware/blob/master/LICENSE
+//
+// File Description:
+//
+// Declarations for the queue of keyboard reports waiting to be sent.
+//
+
+#ifndef INC_REPORT_H_
+#define INC_REPORT_H_
+
+#include <stdint.h>
+#include "descriptors.h"
+
+// Number of reports the workflow engine can build ahead of the host,
+// must be a power of two
+#define REPORT_QUEUE_SIZE 4
+#define REPORT_QUEUE_MASK (REPORT_QUEUE_SIZE - 1)
+
+// The main loop only writes reportHead and the USB interrupt only writes
+// reportTail, so the queue needs no locking. Both count up and wrap at 256,
+// the slot is the count masked by REPORT_QUEUE_MASK.
+extern volatile uint8_t reportHead;
+extern volatile uint8_t reportTail;
+
+#define REPORT_QUEUE_FULL() ((uint8_t)(reportHead - reportTail) == REPORT_QUEUE_SIZE)
+
+void queueReport();
+void sendQueuedReport();
+void reportSent(bool received);
+
+#endif /* INC_REPORT_H_ */
@@ -0,0 +1,113 @@
+//-----------------------------------------------------------------------------
+// storage.h
+//-----------------------------------------------------------------------------
+// Copyright 2018 AstroKey
+// https://github.com/AstroKey/astrokey_firmware/blob/master/LICENSE
+//
+// File Description:
+//
+// Declarations for workflow storage in user data flash.
+//
+
+#ifndef INC_STORAGE_H_
+#define INC_STORAGE_H_
+
+#include <stdint.h>
+#include "astrokey.h"
+#include "EFM8UB1_FlashPrimitives.h"
+
+//////////////////////
+// Storage Layout   //
+//////////////////////
+
+// User data flash is a ring of pages holding a log of workflow records.
+// Saves append a record at the head of the log and the newest record of a
+// switch is its workflow, so most saves write already erased pages. Pages
+// are erased as the oldest end of the log is reclaimed, spreading erases
+// over all of user flash. Records may wrap from the last page to the first.
+// A record only counts once its commit byte is written and its CRC matches,
+// so a save cut short by power loss leaves the previous record in place.
+
+// Marks the first page of a record
+#define RECORD_MAGIC 0xA7
+// Commit byte of a complete record, erased flash reads as uncommitted
+#define RECORD_COMMITTED 0x00
+
+// Pages per workflow in the fixed layout used before the log, migrated when
+// no record is found
+#define LEGACY_WORKFLOW_PAGES 2
+
+// No page found
+#define NO_PAGE 0xFF
+
+// Pages taken by a record holding length bytes of workflow
+#define RECORD_PAGES(length) ((sizeof(RecordHeader_TypeDef) + (length) + USER_PAGE_SIZE - 1) / USER_PAGE_SIZE)
+
+// Bytes written to flash per save step
+#define SAVE_BURST_BYTES 16
+
+// Save steps
+#define SAVE_STATE_IDLE    0
+#define SAVE_STATE_COLLECT 1 // Reclaiming pages at the tail of the log
+#define SAVE_STATE_ERASE   2 // Erasing the pages of the new record
+#define SAVE_STATE_WRITE   3 // Writing the new workflow
+#define SAVE_STATE_COMMIT  4 // Writing the record header
+
+// Save status reported to the host
+#define SAVE_STATUS_IDLE   0 // Nothing saved since reset
+#define SAVE_STATUS_BUSY   1
+#define SAVE_STATUS_DONE   2
+#define SAVE_STATUS_FAILED 3 // The workflow did not fit or did not read back
+
+// Flash address of a user data page
+#define PAGE_ADDR(page) (USER_START_ADDR + ((FLADDR)(page) * USER_PAGE_SIZE))
+
+// Start of each record, followed by the workflow
+typedef struct {
+  uint8_t magic;
+  uint8_t index;
+  // Counts up with every record written, ordering the log
+  uint16_t sequence;
+  uint16_t length;
+  // CRC-16/CCITT of the workflow
+  uint16_t crc;
+  // Written last, on its own
+  uint8_t commit;
+} RecordHeader_TypeDef;
+
+// Newest record of a switch, kept in RAM and rebuilt from the log at boot
+typedef struct {
+  uint8_t page;
+  uint16_t length;
+  // CRC from the record header, so the host can compare workflows cheaply
+  uint16_t crc;
+} WorkflowRecord_TypeDef;
+
+// Progress of the last save
+typedef struct {
+  uint8_t status;
+  uint8_t index;
+  // Bytes written so far and bytes to write
+  uint16_t written;
+  uint16_t length;
+} SaveStatus_TypeDef;
+
+extern volatile SaveStatus_TypeDef SI_SEG_XDATA saveStatus;
+
+///////////////////////
+// Storage Functions //
+///////////////////////
+
+void storageInit();
+bool startSave(uint8_t* workflowData, uint16_t length, uint8_t saveIndex);
+void saveStep();
+bool saveBusy();
+bool saveCompacting();
+uint16_t loadWorkflow(uint8_t* workflowData, uint8_t loadIndex);
+void readWorkflow(uint8_t* workflowData, uint8_t index, uint16_t offset, uint16_t length);
+FLADDR workflowAddress(uint8_t index, uint16_t offset);
+uint16_t workflowSpan(uint8_t index, uint16_t offset);
+uint16_t workflowLength(uint8_t index);
+uint16_t workflowCrc(uint8_t index);
+
+#endif /* INC_STORAGE_H_ */
@@ -139,3 +139,131 @@ void FLASH_PageErase (FLADDR addr)
 
    IE_EA = EA_SAVE;                    // Restore interrupts
 }
+
+//-----------------------------------------------------------------------------
+// FLASH_BlockWrite
+//-----------------------------------------------------------------------------
+//
+// Return Value : None
+// Parameters   :
+//   1) FLADDR dest - starting address of the byte(s) to write to
+//                    valid range is from 0x0000 to 0x1FFF for 8 kB devices
+//                    valid range is from 0x0000 to 0x0FFF for 4 kB devices
+//                    valid range is from 0x0000 to 0x07FF for 2 kB devices
+//   2) uint8_t *src - pointer to source bytes
+//   3) uint16_t numbytes - the number of bytes to write
+//
+// This routine writes <numbytes> from <src> to the linear flash address
+// <dest>.  The VDD monitor is set up once for the whole block and interrupts
+// are only disabled around the key sequence and write of each byte.  Bytes
+// of 0xFF leave erased flash unchanged and are not written.
+// The bytes must be erased to 0xFF before writing.
+//
+//-----------------------------------------------------------------------------
+void FLASH_BlockWrite (FLADDR dest, uint8_t *src, uint16_t numbytes)
+{
+   bool EA_SAVE = IE_EA;                // Preserve IE_EA
+   SI_VARIABLE_SEGMENT_POINTER(pwrite, uint8_t, SI_SEG_XDATA); // Flash write pointer
+   uint8_t byte;
+
+   VDM0CN = 0x80;                      // Enable VDD monitor
+
+   RSTSRC = 0x02;                      // Enable VDD monitor as a reset source
+
+   pwrite = (SI_VARIABLE_SEGMENT_POINTER(, uint8_t, SI_SEG_XDATA)) dest;
+
+   for (; numbytes; numbytes--) {
+      byte = *src++;
+      if (byte != 0xFF) {
+         IE_EA = 0;                    // Disable interrupts
+
+         FLKEY  = 0xA5;                // Key Sequence 1
+         FLKEY  = 0xF1;                // Key Sequence 2
+         PSCTL |= 0x01;                // PSWE = 1 which enables writes
+
+         *pwrite = byte;               // Write the byte
+
+         PSCTL &= ~0x01;               // PSWE = 0 which disable writes
+
+         IE_EA = EA_SAVE;              // Restore interrupts
+      }
+      pwrite++;
+   }
+}
+
+//-----------------------------------------------------------------------------
+// FLASH_BlockRead
+//-----------------------------------------------------------------------------
+//
+// Return Value : None
+// Parameters   :
+//   1) uint8_t *dest - pointer to destination bytes
+//   2) FLADDR src - address of source bytes in flash
+//                    valid range is from 0x0000 to 0x1FFF for 8 kB devices
+//                    valid range is from 0x0000 to 0x0FFF for 4 kB devices
+//                    valid range is from 0x0000 to 0x07FF for 2 kB devices
+//   3) uint16_t numbytes - the number of bytes to read
+//
+// This routine copies <numbytes> from the linear flash address <src> to
+// <dest> with a single MOVC loop.
+//
+//-----------------------------------------------------------------------------
+void FLASH_BlockRead (uint8_t *dest, FLADDR src, uint16_t numbytes)
+{
+   SI_VARIABLE_SEGMENT_POINTER(pread, uint8_t, const SI_SEG_CODE); // Flash read pointer
+
+   pread = (SI_VARIABLE_SEGMENT_POINTER(, uint8_t, const SI_SEG_CODE)) src;
+
+   for (; numbytes; numbytes--) {
+      *dest++ = *pread++;
+   }
+}
+
+//-----------------------------------------------------------------------------
+// FLASH_BlockCopy
+//-----------------------------------------------------------------------------
+//
+// Return Value : None
+// Parameters   :
+//   1) FLADDR dest - starting address of the byte(s) to write to
+//   2) FLADDR src - address of source bytes in flash
+//   3) uint16_t numbytes - the number of bytes to copy
+//
+// This routine copies <numbytes> from the linear flash address <src> to
+// <dest>, setting up the VDD monitor once like FLASH_BlockWrite().  Bytes
+// of 0xFF are not written.
+// The destination bytes must be erased to 0xFF before writing.
+//
+//-----------------------------------------------------------------------------
+void FLASH_BlockCopy (FLADDR dest, FLADDR src, uint16_t numbytes)
+{
+   bool EA_SAVE = IE_EA;                // Preserve IE_EA
+   SI_VARIABLE_SEGMENT_POINTER(pwrite, uint8_t, SI_SEG_XDATA); // Flash write pointer
+   SI_VARIABLE_SEGMENT_POINTER(pread, uint8_t, const SI_SEG_CODE); // Flash read pointer
+   uint8_t byte;
+
+   VDM0CN = 0x80;                      // Enable VDD monitor
+
+   RSTSRC = 0x02;                      // Enable VDD monitor as a reset source
+
+   pwrite = (SI_VARIABLE_SEGMENT_POINTER(, uint8_t, SI_SEG_XDATA)) dest;
+   pread = (SI_VARIABLE_SEGMENT_POINTER(, uint8_t, const SI_SEG_CODE)) src;
+
+   for (; numbytes; numbytes--) {
+      byte = *pread++;
+      if (byte != 0xFF) {
+         IE_EA = 0;                    // Disable interrupts
+
+         FLKEY  = 0xA5;                // Key Sequence 1
+         FLKEY  = 0xF1;                // Key Sequence 2
+         PSCTL |= 0x01;                // PSWE = 1 which enables writes
+
+         *pwrite = byte;               // Write the byte
+
+         PSCTL &= ~0x01;               // PSWE = 0 which disable writes
+
+         IE_EA = EA_SAVE;              // Restore interrupts
+      }
+      pwrite++;
+   }
+}
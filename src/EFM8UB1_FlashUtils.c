@@ -38,6 +38,13 @@ void FLASH_Copy (FLADDR dest, FLADDR src, uint16_t numbytes);
 // Flash test routines
 void FLASH_Fill (FLADDR addr, uint32_t length, uint8_t fill);
 
+// Flash diff routines
+bool FLASH_Compare (FLADDR addr, uint8_t *src, uint16_t numbytes);
+bool FLASH_Programmable (FLADDR dest, uint8_t *src, uint16_t numbytes);
+bool FLASH_Blank (FLADDR addr, uint16_t numbytes);
+void FLASH_WriteDiff (FLADDR dest, uint8_t *src, uint16_t numbytes);
+void FLASH_UpdateDiff (FLADDR dest, uint8_t *src, uint16_t numbytes);
+
 //-----------------------------------------------------------------------------
 // FLASH_Clear
 //-----------------------------------------------------------------------------
@@ -202,15 +209,12 @@ void FLASH_Update (FLADDR dest, uint8_t *src, uint16_t numbytes)
 // This routine copies <numbytes> from <src> to the linear flash address
 // <dest>.  The bytes must be erased to 0xFF before writing.
 // <dest> + <numbytes> must be less than the maximum flash address.
+// Bytes of 0xFF leave erased flash unchanged and are not written.
 //
 //-----------------------------------------------------------------------------
 void FLASH_Write (FLADDR dest, uint8_t *src, uint16_t numbytes)
 {
-   FLADDR i;
-
-   for (i = dest; i < dest+numbytes; i++) {
-      FLASH_ByteWrite (i, *src++);
-   }
+   FLASH_BlockWrite (dest, src, numbytes);
 }
 
 //-----------------------------------------------------------------------------
@@ -235,12 +239,8 @@ void FLASH_Write (FLADDR dest, uint8_t *src, uint16_t numbytes)
 //-----------------------------------------------------------------------------
 uint8_t * FLASH_Read (uint8_t *dest, FLADDR src, uint16_t numbytes)
 {
-   FLADDR i;
-
-   for (i = 0; i < numbytes; i++) {
-      *dest++ = FLASH_ByteRead (src+i);
-   }
-   return dest;
+   FLASH_BlockRead (dest, src, numbytes);
+   return dest + numbytes;
 }
 
 //-----------------------------------------------------------------------------
@@ -263,17 +263,12 @@ uint8_t * FLASH_Read (uint8_t *dest, FLADDR src, uint16_t numbytes)
 // This routine copies <numbytes> from <src> to the linear flash address
 // <dest>.  The destination bytes must be erased to 0xFF before writing.
 // <src>/<dest> + <numbytes> must be less than the maximum flash address.
+// Bytes of 0xFF leave erased flash unchanged and are not written.
 //
 //-----------------------------------------------------------------------------
 void FLASH_Copy (FLADDR dest, FLADDR src, uint16_t numbytes)
 {
-   FLADDR i;
-
-   for (i = 0; i < numbytes; i++) {
-
-      FLASH_ByteWrite ((FLADDR) dest+i,
-                       FLASH_ByteRead((FLADDR) src+i));
-   }
+   FLASH_BlockCopy (dest, src, numbytes);
 }
 
 //-----------------------------------------------------------------------------
@@ -304,3 +299,160 @@ void FLASH_Fill (FLADDR addr, uint32_t length, uint8_t fill)
       FLASH_ByteWrite (addr+i, fill);
    }
 }
+
+//-----------------------------------------------------------------------------
+// FLASH_Compare
+//-----------------------------------------------------------------------------
+//
+// Return Value : true if the flash bytes match <src>
+// Parameters   :
+//   1) FLADDR addr - address of the bytes in flash
+//   2) char *src - pointer to the bytes to compare against
+//   3) uint16_t numbytes - the number of bytes to compare
+//
+// This routine compares <numbytes> of flash starting at <addr> with <src>.
+// <addr> + <numbytes> must be less than the maximum flash address.
+//
+//-----------------------------------------------------------------------------
+bool FLASH_Compare (FLADDR addr, uint8_t *src, uint16_t numbytes)
+{
+   SI_VARIABLE_SEGMENT_POINTER(pread, uint8_t, const SI_SEG_CODE); // Flash read pointer
+
+   pread = (SI_VARIABLE_SEGMENT_POINTER(, uint8_t, const SI_SEG_CODE)) addr;
+
+   for (; numbytes; numbytes--) {
+      if (*pread++ != *src++) {
+         return false;
+      }
+   }
+   return true;
+}
+
+//-----------------------------------------------------------------------------
+// FLASH_Programmable
+//-----------------------------------------------------------------------------
+//
+// Return Value : true if <src> can be written without an erase
+// Parameters   :
+//   1) FLADDR dest - starting address of the byte(s) to write to
+//   2) char *src - pointer to source bytes
+//   3) uint16_t numbytes - the number of bytes to check
+//
+// This routine checks that writing <src> to the flash addressed by <dest>
+// only clears bits, which a write can do without erasing the page first.
+// <dest> + <numbytes> must be less than the maximum flash address.
+//
+//-----------------------------------------------------------------------------
+bool FLASH_Programmable (FLADDR dest, uint8_t *src, uint16_t numbytes)
+{
+   SI_VARIABLE_SEGMENT_POINTER(pread, uint8_t, const SI_SEG_CODE); // Flash read pointer
+
+   pread = (SI_VARIABLE_SEGMENT_POINTER(, uint8_t, const SI_SEG_CODE)) dest;
+
+   for (; numbytes; numbytes--) {
+      if ((*pread++ & *src) != *src) {
+         return false;
+      }
+      src++;
+   }
+   return true;
+}
+
+//-----------------------------------------------------------------------------
+// FLASH_Blank
+//-----------------------------------------------------------------------------
+//
+// Return Value : true if the flash bytes are all erased
+// Parameters   :
+//   1) FLADDR addr - address of the bytes in flash
+//   2) uint16_t numbytes - the number of bytes to check
+//
+// This routine checks that <numbytes> of flash starting at <addr> read as
+// 0xFF.
+// <addr> + <numbytes> must be less than the maximum flash address.
+//
+//-----------------------------------------------------------------------------
+bool FLASH_Blank (FLADDR addr, uint16_t numbytes)
+{
+   SI_VARIABLE_SEGMENT_POINTER(pread, uint8_t, const SI_SEG_CODE); // Flash read pointer
+
+   pread = (SI_VARIABLE_SEGMENT_POINTER(, uint8_t, const SI_SEG_CODE)) addr;
+
+   for (; numbytes; numbytes--) {
+      if (*pread++ != 0xFF) {
+         return false;
+      }
+   }
+   return true;
+}
+
+//-----------------------------------------------------------------------------
+// FLASH_WriteDiff
+//-----------------------------------------------------------------------------
+//
+// Return Value : None
+// Parameters   :
+//   1) FLADDR dest - starting address of the byte(s) to write to
+//   2) char *src - pointer to source bytes
+//   3) uint16_t numbytes - the number of bytes to write
+//
+// This routine writes the bytes of <src> that differ from the flash
+// addressed by <dest>, one FLASH_BlockWrite() per run of differing bytes.
+// The write must be programmable without an erase, see FLASH_Programmable().
+// <dest> + <numbytes> must be less than the maximum flash address.
+//
+//-----------------------------------------------------------------------------
+void FLASH_WriteDiff (FLADDR dest, uint8_t *src, uint16_t numbytes)
+{
+   SI_VARIABLE_SEGMENT_POINTER(pread, uint8_t, const SI_SEG_CODE); // Flash read pointer
+   uint16_t i;
+   uint16_t start;
+
+   pread = (SI_VARIABLE_SEGMENT_POINTER(, uint8_t, const SI_SEG_CODE)) dest;
+
+   i = 0;
+   while (i < numbytes) {
+      // Skip the bytes that already match
+      if (pread[i] == src[i]) {
+         i++;
+         continue;
+      }
+
+      // Write the whole run of differing bytes at once
+      start = i;
+      while (i < numbytes && pread[i] != src[i]) {
+         i++;
+      }
+      FLASH_BlockWrite (dest+start, src+start, i-start);
+   }
+}
+
+//-----------------------------------------------------------------------------
+// FLASH_UpdateDiff
+//-----------------------------------------------------------------------------
+//
+// Return Value : None
+// Parameters   :
+//   1) FLADDR dest - starting address of the byte(s) to write to
+//   2) char *src - pointer to source bytes
+//   3) uint16_t numbytes - the number of bytes to update
+//                              valid range is 0 to FLASH_PAGESIZE
+//
+// This routine replaces <numbytes> from <src> to the flash addressed by
+// <dest> like FLASH_Update(), but leaves the flash alone if it already
+// matches and skips the erase if the new bytes only clear bits.
+// <dest> + <numbytes> must be less than the maximum flash address.
+//
+//-----------------------------------------------------------------------------
+void FLASH_UpdateDiff (FLADDR dest, uint8_t *src, uint16_t numbytes)
+{
+   if (FLASH_Compare (dest, src, numbytes)) {
+      return;
+   }
+
+   if (FLASH_Programmable (dest, src, numbytes)) {
+      FLASH_WriteDiff (dest, src, numbytes);
+   } else {
+      FLASH_Update (dest, src, numbytes);
+   }
+}
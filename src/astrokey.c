@@ -9,45 +9,99 @@
 // Implementation of AstroKey input polling and other device-specific functionality.
 //
 
+#include <string.h>
 #include "astrokey.h"
 #include "InitDevice.h"
 #include "efm8_usb.h"
 #include "descriptors.h"
 #include "idle.h"
 #include "delay.h"
-#include "EFM8UB1_FlashPrimitives.h"
-#include "EFM8UB1_FlashUtils.h"
+#include "storage.h"
+#include "report.h"
+#include "usb_0.h"
+#include "debounce.h"
 
 // ----------------------------------------------------------------------------
 // Variables
 // ----------------------------------------------------------------------------
-// Number of keys currently being pressed by the workflow
+// Number of keys currently being pressed by the workflow in boot protocol
 uint8_t keysPressed = 0;
 // The current report to send the
-volatile KeyReport_TypeDef keyReport =
+volatile KeyReport_TypeDef SI_SEG_XDATA keyReport =
 {
   0,
   0,
-  {0, 0, 0, 0, 0, 0}
+  {0, 0, 0, 0, 0, 0},
+  {0}
 };
+// Protocol selected by the host, devices power up in report protocol
+volatile uint8_t keyReportProtocol = HID_PROTOCOL_REPORT;
 
-volatile bool keyReportSent = false;
-volatile int8_t workflowUpdated = -1;
-Action_TypeDef SI_SEG_XDATA tmpWorkflow[WORKFLOW_MAX_SIZE];
+// Mask of each bit in a byte, used for the modifier byte and the key bitmap
+SI_SEGMENT_VARIABLE(bitMasks[8], const uint8_t, SI_SEG_CODE) =
+{
+  0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80
+};
+
+// US layout usage of each ASCII character for STRING actions, ORed with
+// ASCII_SHIFT if the character needs shift held, 0 if it cannot be typed
+SI_SEGMENT_VARIABLE(asciiToUsage[128], const uint8_t, SI_SEG_CODE) =
+{
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 00 01 02 03 04 05 06 07
+  0x2A, 0x2B, 0x28, 0x00, 0x00, 0x00, 0x00, 0x00, // BS TAB LF 0B 0C 0D 0E 0F
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 10 11 12 13 14 15 16 17
+  0x00, 0x00, 0x00, 0x29, 0x00, 0x00, 0x00, 0x00, // 18 19 1A ESC 1C 1D 1E 1F
+  0x2C, 0x9E, 0xB4, 0xA0, 0xA1, 0xA2, 0xA4, 0x34, // SP ! " # $ % & '
+  0xA6, 0xA7, 0xA5, 0xAE, 0x36, 0x2D, 0x37, 0x38, // ( ) * + , - . /
+  0x27, 0x1E, 0x1F, 0x20, 0x21, 0x22, 0x23, 0x24, // 0 1 2 3 4 5 6 7
+  0x25, 0x26, 0xB3, 0x33, 0xB6, 0x2E, 0xB7, 0xB8, // 8 9 : ; < = > ?
+  0x9F, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8A, // @ A B C D E F G
+  0x8B, 0x8C, 0x8D, 0x8E, 0x8F, 0x90, 0x91, 0x92, // H I J K L M N O
+  0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, // P Q R S T U V W
+  0x9B, 0x9C, 0x9D, 0x2F, 0x31, 0x30, 0xA3, 0xAD, // X Y Z [ \ ] ^ _
+  0x35, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, // ` a b c d e f g
+  0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x10, 0x11, 0x12, // h i j k l m n o
+  0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1A, // p q r s t u v w
+  0x1B, 0x1C, 0x1D, 0xAF, 0xB1, 0xB0, 0xB5, 0x4C  // x y z { | } ~ DEL
+};
+
+uint8_t SI_SEG_XDATA tmpWorkflow[WORKFLOW_MAX_BYTES];
+
+StagedWorkflow_TypeDef SI_SEG_XDATA stagingQueue[STAGING_QUEUE_SIZE];
+volatile uint8_t stagingHead = 0;
+volatile uint8_t stagingTail = 0;
+volatile bool stagingReceiving = false;
+volatile uint8_t uploadFailures = 0;
+uint8_t SI_SEG_XDATA streamRing[STREAM_RING_SIZE];
+uint16_t streamHead = 0;
 
-// The data of the current workflow
-Action_TypeDef SI_SEG_XDATA workflow[WORKFLOW_MAX_SIZE];
+// Set while the upload at stagingTail is being saved
+bool stagingSaving = false;
 
-// Index of current workflow running (i.e. 0 for 1st key, etc.)
-uint8_t workflowIndex = NO_WORKFLOW;
+// The workflow of each switch
+WorkflowRunner_TypeDef SI_SEG_XDATA runners[NUM_RUNNERS];
+// The runner being stepped and its index
+SI_VARIABLE_SEGMENT_POINTER(runner, WorkflowRunner_TypeDef, SI_SEG_XDATA);
+uint8_t runnerIndex;
 
-// Index of current action in current workflow running;
-uint8_t actionIndices[NUM_SWITCHES] = {0};
+// Bit n is set if the workflow of switch n needs stepping
+volatile uint8_t runningWorkflows = 0;
+// What happens when a switch is pressed while other workflows are running
+volatile uint8_t workflowPolicy = WORKFLOW_POLICY_CONCURRENT;
+
+// Set by interrupts when the main loop has work to do
+volatile bool mainLoopWake = true;
+// Set when the key report must be rebuilt for another protocol
+volatile bool protocolChanged = false;
+
+// Number of workflows holding each key down, a key is reported down while
+// any workflow holds it
+uint8_t SI_SEG_XDATA keyRefs[NUM_KEY_USAGES];
 
 // The UUID String descriptor
 UTF16LE_PACKED_STRING_DESC(serDesc[SER_STR_LEN + USB_STRING_DESCRIPTOR_NAME], SER_STR_LEN);
 
-// Checks if a key is currently pressed by the workflow
+// Checks if a key is currently pressed by the workflows in boot protocol
 // Returns the index of the key in array of keys currently pressed,
 // -1 if the key is not currently being pressed
 int8_t keyIsPressed(uint8_t key)
@@ -64,35 +118,36 @@ int8_t keyIsPressed(uint8_t key)
 // Presses down a key
 void pressKey(uint8_t key)
 {
-  if (keyIsPressed(key) == -1 && keysPressed < WORKFLOW_MAX_KEYS)
+  if (IS_MODIFIER(key))
   {
-    keyReport.keys[keysPressed] = key;
-    keysPressed++;
+    keyReport.modifiers |= bitMasks[key - USAGE_LEFTCTRL];
   }
-  // Switch case seems to use 1 more byte of code than cascaded if else ifs with many conditions,
-  // but runs faster
-  switch (key)
+  else if (keyReportProtocol == HID_PROTOCOL_REPORT)
   {
-    case USAGE_LEFTCTRL:
-      keyReport.modifiers |= MODIFIER_LEFTCTRL;
-      break;
-    case USAGE_LEFTSHIFT:
-      keyReport.modifiers |= MODIFIER_LEFTSHIFT;
-      break;
-    case USAGE_LEFTALT:
-      keyReport.modifiers |= MODIFIER_LEFTALT;
-      break;
-    case USAGE_LEFTGUI:
-      keyReport.modifiers |= MODIFIER_LEFTGUI;
-      break;
+    if (key < REPORT_BITMAP_USAGES)
+      keyReport.bitmap[key >> 3] |= bitMasks[key & 0x07];
+  }
+  else if (keyIsPressed(key) == -1 && keysPressed < WORKFLOW_MAX_KEYS)
+  {
+    keyReport.keys[keysPressed] = key;
+    keysPressed++;
   }
 }
 
 // Releases a key currently being pressed
 void releaseKey(uint8_t key)
 {
-  uint8_t keyIndex;
-  if ((keyIndex = keyIsPressed(key)) != -1)
+  int8_t keyIndex;
+  if (IS_MODIFIER(key))
+  {
+    keyReport.modifiers &= ~bitMasks[key - USAGE_LEFTCTRL];
+  }
+  else if (keyReportProtocol == HID_PROTOCOL_REPORT)
+  {
+    if (key < REPORT_BITMAP_USAGES)
+      keyReport.bitmap[key >> 3] &= ~bitMasks[key & 0x07];
+  }
+  else if ((keyIndex = keyIsPressed(key)) != -1)
   {
     // Switch last key pressed to position of key being released
     keyReport.keys[keyIndex] = keyReport.keys[keysPressed - 1];
@@ -100,152 +155,608 @@ void releaseKey(uint8_t key)
     keyReport.keys[keysPressed - 1] = 0;
     keysPressed--;
   }
-  switch (key)
+}
+
+// Rebuilds the key report in the format of the protocol the host selected
+// Keys pressed under the old protocol would otherwise never be released
+void rebuildReport()
+{
+  uint8_t key;
+
+  memset((KeyReport_TypeDef SI_SEG_XDATA *) &keyReport, 0, sizeof(KeyReport_TypeDef));
+  keysPressed = 0;
+
+  for (key = 0; key < NUM_KEY_USAGES; key++)
+  {
+    if (keyRefs[key] != 0)
+      pressKey(key);
+  }
+}
+
+// Keys that have already changed state in the report currently being built
+uint8_t SI_SEG_XDATA frameKeys[WORKFLOW_MAX_FRAME_KEYS];
+// Number of keys that have changed state in the current report
+uint8_t numFrameKeys = 0;
+
+// Claims a key for a state change in the current report
+// Returns false if the key has already changed state in this report,
+// as a second change would hide the first from the host
+bool claimKey(uint8_t key)
+{
+  uint8_t i;
+  if (numFrameKeys == WORKFLOW_MAX_FRAME_KEYS)
+    return false;
+  for (i = 0; i < numFrameKeys; i++)
   {
-    case USAGE_LEFTCTRL:
-      keyReport.modifiers &= ~MODIFIER_LEFTCTRL;
-      break;
-    case USAGE_LEFTSHIFT:
-      keyReport.modifiers &= ~MODIFIER_LEFTSHIFT;
-      break;
-    case USAGE_LEFTALT:
-      keyReport.modifiers &= ~MODIFIER_LEFTALT;
-      break;
-    case USAGE_LEFTGUI:
-      keyReport.modifiers &= ~MODIFIER_LEFTGUI;
-      break;
+    if (frameKeys[i] == key)
+      return false;
   }
+  frameKeys[numFrameKeys] = key;
+  numFrameKeys++;
+  return true;
 }
 
-bool curPressDown = false;
-bool delayStarted = false;
-uint32_t delayStartTime;
+// Sets the state of the current runner
+void setRunnerState(uint8_t state)
+{
+  runner->state = state;
+  if (state == RUNNER_RUNNING || state == RUNNER_ABORTING)
+    runningWorkflows |= bitMasks[runnerIndex];
+  else
+    runningWorkflows &= ~bitMasks[runnerIndex];
 
-// Advances the workflow one action forward, ending it if the end is reached
-void stepWorkflow()
+  // Saves wait for every workflow to stop
+  if (runningWorkflows == 0)
+    mainLoopWake = true;
+}
+
+// Checks if the current workflow is holding a key down
+bool keyHeld(uint8_t key)
 {
-  uint8_t actionType = workflow[actionIndices[workflowIndex]].actionType;
-  uint8_t value = workflow[actionIndices[workflowIndex]].value;
+  return (runner->held[key >> 3] & bitMasks[key & 0x07]) != 0;
+}
+
+// Holds a key down for the current workflow
+void holdKey(uint8_t key)
+{
+  if (keyHeld(key))
+    return;
+  runner->held[key >> 3] |= bitMasks[key & 0x07];
+  if (keyRefs[key]++ == 0)
+    pressKey(key);
+}
+
+// Stops holding a key down for the current workflow
+void unholdKey(uint8_t key)
+{
+  if (!keyHeld(key))
+    return;
+  runner->held[key >> 3] &= ~bitMasks[key & 0x07];
+  if (--keyRefs[key] == 0)
+    releaseKey(key);
+}
+
+// Reads a byte of the current workflow
+// Reading past the end of the stored workflow gives the end action
+uint8_t workflowByte(uint16_t offset)
+{
+  uint16_t address;
+
+  if (runnerIndex == STREAM_RUNNER)
+    return streamRing[offset & STREAM_RING_MASK];
+  if (offset >= runner->length)
+    return WORKFLOW_ACTION_END;
+  address = runner->address + offset;
+  if (address >= USER_END_ADDR)
+    address -= USER_NUM_BYTES;
+  return *((SI_VARIABLE_SEGMENT_POINTER(, const uint8_t, SI_SEG_CODE)) address);
+}
+
+// Number of bytes in an action
+uint16_t actionLength(uint8_t actionType, uint8_t value)
+{
+  if ((actionType & WORKFLOW_ACTION_TAP_MASK) == WORKFLOW_ACTION_TAP
+      || (actionType & WORKFLOW_ACTION_MODIFIER_MASK) == WORKFLOW_ACTION_MODIFIER)
+    return 1;
+
   switch (actionType)
   {
     case WORKFLOW_ACTION_DOWN:
-      pressKey(value);
-      actionIndices[workflowIndex]++;
-      break;
     case WORKFLOW_ACTION_UP:
-      releaseKey(value);
-      actionIndices[workflowIndex]++;
-      break;
     case WORKFLOW_ACTION_PRESS:
-      if (curPressDown)
-      {
-        releaseKey(value);
-        curPressDown = false;
-        actionIndices[workflowIndex]++;
-      }
-      else
-      {
-        pressKey(value);
-        curPressDown = true;
-      }
-      break;
     case WORKFLOW_ACTION_DELAY:
-      if (!delayStarted)
-      {
-        delayStarted = true;
-        delayStartTime = getMillis();
-      }
-      else if ((getMillis() - delayStartTime) > ((uint32_t)value * 10))
+    case WORKFLOW_ACTION_REPEAT:
+    case WORKFLOW_ACTION_PAUSE:
+      return 2;
+    case WORKFLOW_ACTION_DELAY_MS:
+      return 3;
+    case WORKFLOW_ACTION_STRING:
+      return 2 + (uint16_t)value;
+  }
+  // End of workflow, unprogrammed flash or an unknown action
+  return 1;
+}
+
+// Checks if the stream runner has to wait for more of the action at offset
+bool streamWaiting(uint16_t offset, uint16_t length)
+{
+  uint16_t received = streamHead - offset;
+
+  // The length of an action is only known once its second byte is received
+  if (received == 0 || (length > 1 && received < 2))
+    return true;
+  return length <= STREAM_RING_SIZE && received < length;
+}
+
+// Moves the current runner past an action
+// The USB interrupt reads the offset of the stream runner for GET_STREAM,
+// so it must not see half of the update
+void advanceRunner(uint16_t length)
+{
+  USB_DisableInts();
+  runner->offset += length;
+  USB_EnableInts();
+}
+
+// Clears the progress of the current runner through its current action
+void resetRunner()
+{
+  runner->released = false;
+  runner->pressDown = false;
+  runner->delayStarted = false;
+  runner->stringIndex = 0;
+  runner->repeatCount = 0;
+}
+
+// Moves past the current action once it has run as many times as a REPEAT asked for
+void finishAction(uint16_t length)
+{
+  // Only a delay straight after a switch edge is timed from the edge
+  runner->delayStarted = false;
+  if (runner->repeatCount > 1)
+  {
+    runner->repeatCount--;
+  }
+  else
+  {
+    runner->repeatCount = 0;
+    advanceRunner(length);
+  }
+}
+
+// Presses or releases a key if it has not changed state in this report yet
+bool changeKey(uint8_t key, bool down)
+{
+  if (key >= NUM_KEY_USAGES)
+    return true;
+  if (!claimKey(key))
+    return false;
+  if (down)
+    holdKey(key);
+  else
+    unholdKey(key);
+  // The report being built is sent once the tail count passes its slot
+  runner->reportPending = true;
+  runner->pendingReport = reportHead + 1;
+  return true;
+}
+
+// Presses a key and releases it in a later report, with shift held around it if requested
+// Returns true once the key has been released
+bool tapKey(uint8_t key, bool shift)
+{
+  uint8_t numClaimed = numFrameKeys;
+
+  if (key >= NUM_KEY_USAGES)
+    return true;
+
+  // Shift is only pressed and released if the workflow is not already holding it
+  if (!runner->pressDown)
+    runner->pressShift = shift && !keyHeld(USAGE_LEFTSHIFT);
+
+  // Shift and the key change state in the same report
+  if (!claimKey(key) || (runner->pressShift && !claimKey(USAGE_LEFTSHIFT)))
+  {
+    numFrameKeys = numClaimed;
+    return false;
+  }
+  runner->reportPending = true;
+  runner->pendingReport = reportHead + 1;
+
+  if (runner->pressDown)
+  {
+    unholdKey(key);
+    if (runner->pressShift)
+      unholdKey(USAGE_LEFTSHIFT);
+    runner->pressDown = false;
+    return true;
+  }
+
+  if (runner->pressShift)
+    holdKey(USAGE_LEFTSHIFT);
+  holdKey(key);
+  runner->pressDown = true;
+  return false;
+}
+
+// Types the characters of a STRING action starting at offset
+// Returns true once every character has been typed
+bool typeString(uint16_t offset, uint8_t length)
+{
+  uint8_t usage;
+  while (runner->stringIndex < length)
+  {
+    usage = asciiToUsage[workflowByte(offset + 2 + runner->stringIndex) & 0x7F];
+    // Characters that cannot be typed are skipped
+    if (usage != 0 && !tapKey(usage & ~ASCII_SHIFT, (usage & ASCII_SHIFT) != 0))
+      return false;
+    runner->stringIndex++;
+  }
+  runner->stringIndex = 0;
+  return true;
+}
+
+// Waits for a delay to pass, returns true once it has
+bool waitDelay(uint16_t delayLength)
+{
+  // Keys changed before the delay must reach the host before it starts
+  if (runner->reportPending)
+    return false;
+
+  if (!runner->delayStarted)
+  {
+    runner->delayStarted = true;
+    runner->delayStartTime = getMillis();
+  }
+  else if ((getMillis() - runner->delayStartTime) > delayLength)
+  {
+    runner->delayStarted = false;
+    return true;
+  }
+  return false;
+}
+
+// Releases the keys held by the current workflow, going idle once all are released
+void abortRunner()
+{
+  uint8_t key;
+  bool released = true;
+
+  for (key = 0; key < NUM_KEY_USAGES; key++)
+  {
+    if (keyHeld(key) && !changeKey(key, false))
+      released = false;
+  }
+
+  if (released)
+    setRunnerState(RUNNER_IDLE);
+}
+
+// Advances the current workflow as far as one report allows, ending it if the end is reached
+// Consecutive key actions are coalesced into the same report until a key would
+// change state twice, or a DELAY or PAUSE is reached
+void stepRunner()
+{
+  uint16_t offset;
+  uint16_t length;
+  uint8_t actionType;
+  uint8_t value;
+  uint8_t numActions = 0;
+  bool actionDone;
+
+  while (runner->state == RUNNER_RUNNING)
+  {
+    // Bound the time spent on one report, the rest of the workflow continues
+    // in the next one
+    if (numActions == WORKFLOW_MAX_FRAME_ACTIONS)
+      break;
+    numActions++;
+
+    offset = runner->offset;
+    actionType = workflowByte(offset);
+    value = workflowByte(offset + 1);
+    length = actionLength(actionType, value);
+
+    if (runnerIndex == STREAM_RUNNER)
+    {
+      // Streamed actions run once they are received whole
+      if (streamWaiting(offset, length))
+        break;
+      // Actions that can never fit in the ring end the stream
+      if (length > STREAM_RING_SIZE)
+        actionType = WORKFLOW_ACTION_END;
+    }
+
+    if ((actionType & WORKFLOW_ACTION_TAP_MASK) == WORKFLOW_ACTION_TAP)
+    {
+      actionDone = tapKey(actionType & ~WORKFLOW_ACTION_TAP_MASK, false);
+    }
+    else if ((actionType & WORKFLOW_ACTION_MODIFIER_MASK) == WORKFLOW_ACTION_MODIFIER)
+    {
+      actionDone = changeKey(USAGE_LEFTCTRL + (actionType & 0x07),
+                             !(actionType & WORKFLOW_ACTION_MODIFIER_UP));
+    }
+    else
+    {
+      switch (actionType)
       {
-        delayStarted = false;
-        actionIndices[workflowIndex]++;
+        case WORKFLOW_ACTION_DOWN:
+          actionDone = changeKey(value, true);
+          break;
+        case WORKFLOW_ACTION_UP:
+          actionDone = changeKey(value, false);
+          break;
+        case WORKFLOW_ACTION_PRESS:
+          actionDone = tapKey(value, false);
+          break;
+        case WORKFLOW_ACTION_STRING:
+          actionDone = typeString(offset, value);
+          break;
+        case WORKFLOW_ACTION_DELAY:
+          actionDone = waitDelay((uint16_t)value * 10);
+          break;
+        case WORKFLOW_ACTION_DELAY_MS:
+          actionDone = waitDelay(value | ((uint16_t)workflowByte(offset + 2) << 8));
+          break;
+        case WORKFLOW_ACTION_REPEAT:
+          runner->repeatCount = value;
+          advanceRunner(length);
+          continue;
+        case WORKFLOW_ACTION_PAUSE:
+          advanceRunner(length);
+          runner->repeatCount = 0;
+          // Carry on straight away if the switch has already been released,
+          // streams have no switch to wait for
+          if (runner->released || runnerIndex == STREAM_RUNNER)
+            runner->released = false;
+          else
+            setRunnerState(RUNNER_PAUSED);
+          continue;
+        default:
+          // End of workflow, unprogrammed flash or an unknown action
+          runner->repeatCount = 0;
+          // The end of a stream is played, so the next stream follows it,
+          // straight away if it has already been received
+          if (runnerIndex == STREAM_RUNNER && length <= STREAM_RING_SIZE)
+          {
+            advanceRunner(length);
+            if (runner->offset != streamHead)
+            {
+              resetRunner();
+              continue;
+            }
+          }
+          setRunnerState(RUNNER_IDLE);
+          continue;
       }
+    }
+
+    if (!actionDone)
       break;
-    default:
-      actionIndices[workflowIndex]++;
-      break;
+    finishAction(length);
+  }
+}
+
+// Advances every running workflow as far as one report allows and queues the report
+void stepWorkflow()
+{
+  numFrameKeys = 0;
+
+  for (runnerIndex = 0; runnerIndex < NUM_RUNNERS; runnerIndex++)
+  {
+    runner = &runners[runnerIndex];
+
+    // Check if the last key change of the workflow has reached the host
+    if (runner->reportPending && (int8_t)(reportTail - runner->pendingReport) >= 0)
+      runner->reportPending = false;
+
+    if (runner->state == RUNNER_RUNNING)
+      stepRunner();
+    else if (runner->state == RUNNER_ABORTING)
+      abortRunner();
   }
 
-  keyReportSent = false;
+  // Reports that would not change the key state are not sent
+  if (numFrameKeys > 0)
+    queueReport();
+}
+
+// Points the current runner at its workflow in flash
+void loadRunner()
+{
+  runner->address = workflowAddress(runnerIndex, 0);
+  runner->length = workflowLength(runnerIndex);
+}
+
+// Millisecond count of a switch edge from the low 16 bits queued with it
+uint32_t edgeMillis(uint16_t time)
+{
+  uint32_t now = getMillis();
+  return now - (uint16_t)((uint16_t)now - time);
+}
+
+// Times a delay at the current action of the current runner from a switch
+// edge, so edges handled late do not lengthen it
+void startDelayAt(uint16_t time)
+{
+  runner->delayStarted = true;
+  runner->delayStartTime = edgeMillis(time);
+}
+
+// Starts running the workflow of a switch that was pressed at a time
+void startWorkflow(uint8_t index, uint16_t time)
+{
+  uint8_t i;
 
-  if (actionType == 0x00 || actionType == WORKFLOW_ACTION_UNPROGRAMMED ||
-      actionIndices[workflowIndex] == WORKFLOW_MAX_SIZE)
+  ENGINE_LOCK();
+  if (workflowPolicy == WORKFLOW_POLICY_EXCLUSIVE
+      && (runningWorkflows & ~bitMasks[index] & ~bitMasks[STREAM_RUNNER]))
   {
-    workflowIndex = NO_WORKFLOW;
+    ENGINE_UNLOCK();
+    return;
   }
-  else if (actionType == WORKFLOW_ACTION_PAUSE)
+
+  for (i = 0; i < NUM_SWITCHES; i++)
   {
-    actionIndices[workflowIndex]++;
-    workflowIndex = NO_WORKFLOW;
+    runnerIndex = i;
+    runner = &runners[i];
+
+    if (i == index)
+    {
+      // A workflow that is still running is not restarted
+      if (runner->state == RUNNER_RUNNING || runner->state == RUNNER_ABORTING)
+        continue;
+      loadRunner();
+      runner->offset = 0;
+      resetRunner();
+      startDelayAt(time);
+      setRunnerState(RUNNER_RUNNING);
+    }
+    else if (workflowPolicy == WORKFLOW_POLICY_PREEMPT && runner->state != RUNNER_IDLE)
+    {
+      setRunnerState(RUNNER_ABORTING);
+    }
   }
+  ENGINE_UNLOCK();
 }
 
-void saveWorkflow(Action_TypeDef* workflowData, uint8_t saveIndex)
+// Resumes the workflow of a switch that was released at a time from its PAUSE
+void resumeWorkflow(uint8_t index, uint16_t time)
 {
-  uint8_t i;
-  FLADDR flashAddr = WORKFLOW_FLASH_ADDR + (saveIndex * WORKFLOW_BYTES);
-  for (i = 0; i < WORKFLOW_PAGES; i++)
-    FLASH_PageErase(flashAddr + (USER_PAGE_SIZE * i));
-  FLASH_Write(flashAddr, (uint8_t*) workflowData, WORKFLOW_BYTES);
+  ENGINE_LOCK();
+  runnerIndex = index;
+  runner = &runners[index];
+  if (runner->state == RUNNER_PAUSED)
+  {
+    // Flash may have been rewritten while the workflow was paused
+    loadRunner();
+    startDelayAt(time);
+    setRunnerState(RUNNER_RUNNING);
+  }
+  else if (runner->state == RUNNER_RUNNING)
+  {
+    runner->released = true;
+  }
+  ENGINE_UNLOCK();
 }
 
-void loadWorkflow(Action_TypeDef* workflowData, uint8_t loadIndex)
+// Number of streamed bytes played so far
+// The main loop must hold ENGINE_LOCK, as the SOF interrupt may be stepping
+// the stream
+uint16_t streamPlayed()
 {
-  FLADDR flashAddr = WORKFLOW_FLASH_ADDR + (loadIndex * WORKFLOW_BYTES);
-  FLASH_Read((uint8_t *)workflowData, flashAddr, WORKFLOW_BYTES);
+  return runners[STREAM_RUNNER].offset;
 }
 
-// Starts running a workflow
-void startWorkflow(uint8_t index)
+// Bytes of actions the host may still stream without overflowing the ring
+// No bytes are taken while the stream is being reset
+// Called from the main loop
+uint8_t streamCredits()
 {
-  workflowIndex = index;
-  actionIndices[workflowIndex] = 0;
+  uint8_t credits = 0;
 
-  loadWorkflow(workflow, index);
-  stepWorkflow();
+  ENGINE_LOCK();
+  if (runners[STREAM_RUNNER].state != RUNNER_ABORTING)
+    credits = STREAM_RING_SIZE - (uint16_t)(streamHead - runners[STREAM_RUNNER].offset);
+  ENGINE_UNLOCK();
+  return credits;
 }
 
-void resumeWorkflow(uint8_t index)
+// Adds a streamed byte to the ring, starting the stream runner if it is idle
+// The caller checks streamCredits first
+void streamAppend(uint8_t value)
 {
-  workflowIndex = index;
+  streamRing[streamHead & STREAM_RING_MASK] = value;
+
+  // The USB interrupt reads streamHead, so it changes with the interrupt
+  // held off in every build
+  USB_DisableInts();
+  streamHead++;
+  runnerIndex = STREAM_RUNNER;
+  runner = &runners[STREAM_RUNNER];
+  if (runner->state == RUNNER_IDLE)
+  {
+    resetRunner();
+    setRunnerState(RUNNER_RUNNING);
+  }
+  USB_EnableInts();
+}
 
-  loadWorkflow(workflow, index);
-  stepWorkflow();
+// Drops the actions not yet played and releases the keys held by the stream
+void streamReset()
+{
+  USB_DisableInts();
+  runnerIndex = STREAM_RUNNER;
+  runner = &runners[STREAM_RUNNER];
+  streamHead = runner->offset;
+  if (runner->state != RUNNER_IDLE)
+    setRunnerState(RUNNER_ABORTING);
+  USB_EnableInts();
 }
 
+// Switches pressed as of the last edge handled
 uint8_t wasPressed = 0x00;
 
-uint8_t checkKeyPressed(uint8_t bitMask, uint8_t pressed)
+// The last switch edge handled, for debugging
+SwitchEvent_TypeDef SI_SEG_XDATA lastSwitchEvent;
+
+// Starts or resumes the workflow of a switch when it is pressed or released,
+// time is the low 16 bits of the millisecond count of the edge
+// Edges that do not change the state already handled are ignored
+void switchChanged(uint8_t index, bool pressed, uint16_t time)
 {
-  uint8_t retVal = 0;
+  if (pressed == ((wasPressed & bitMasks[index]) != 0))
+    return;
+  wasPressed ^= bitMasks[index];
 
   if (pressed)
-  {
-    if (0 == (wasPressed & bitMask))
-      retVal = 1;
-    wasPressed |= bitMask;
-  }
-
-  return retVal;
+    startWorkflow(index, time);
+  else
+    resumeWorkflow(index, time);
 }
 
-uint8_t checkKeyReleased(uint8_t bitMask, uint8_t pressed)
+// Handles every queued switch edge in the order they happened
+void handleSwitchEvents()
 {
-  uint8_t retVal = 0;
+  uint8_t i;
+  uint8_t pressed;
+  // Edges that were not queued are timed from now
+  uint16_t now = getMillis();
+
+  // Start the workflows of switches that woke the host straight away, the
+  // debounced state is updated so their release is seen
+  if (wakeupSwitches != 0)
+  {
+    pressed = wakeupSwitches;
+    wakeupSwitches &= ~pressed;
+    debouncedSwitches |= pressed;
+    for (i = 0; i < NUM_SWITCHES; i++)
+    {
+      if (pressed & bitMasks[i])
+        switchChanged(i, true, now);
+    }
+  }
 
-  if (!pressed)
+  while (popSwitchEvent(&lastSwitchEvent))
   {
-    if (wasPressed & bitMask)
-      retVal = 1;
-    wasPressed &= ~bitMask;
+    switchChanged(lastSwitchEvent.event & SWITCH_EVENT_INDEX,
+                  (lastSwitchEvent.event & SWITCH_EVENT_PRESSED) != 0,
+                  lastSwitchEvent.time);
   }
 
-  return retVal;
+  // Catch up with edges that did not fit in the queue
+  if (switchEventsDropped)
+  {
+    switchEventsDropped = false;
+    for (i = 0; i < NUM_SWITCHES; i++)
+      switchChanged(i, (debouncedSwitches & bitMasks[i]) != 0, now);
+  }
 }
 
 void astrokeyInit()
 {
   uint8_t i;
+  uint8_t sfrPage = SFRPAGE;
   // Read chip UUID and write hex string to serial string descriptor
   for (i = 0; i < UUID_LEN; i++)
   {
@@ -254,55 +765,142 @@ void astrokeyInit()
     serDesc[USB_STRING_DESCRIPTOR_NAME + 2 * i + 1] =
       NIBBLE_TO_ASCII((UUID[i] >> 0) & 0x0F);
   }
-  // Enter default device configuration
-  enter_DefaultMode_from_RESET();
+  // No workflows running or keys held
+  memset(runners, 0, sizeof(runners));
+  memset(keyRefs, 0, sizeof(keyRefs));
+  // Enter default device configuration, in the order of
+  // enter_DefaultMode_from_RESET. Finding where each workflow is stored can
+  // migrate them, so it runs once the watchdog is off and the clock is up,
+  // but before the timer, interrupts and USB start using the workflows.
+  WDT_0_enter_DefaultMode_from_RESET();
+  VREG_0_enter_DefaultMode_from_RESET();
+  PORTS_0_enter_DefaultMode_from_RESET();
+  PBCFG_0_enter_DefaultMode_from_RESET();
+  CIP51_0_enter_DefaultMode_from_RESET();
+  CLOCK_0_enter_DefaultMode_from_RESET();
+  SFRPAGE = sfrPage;
+  storageInit();
+  TIMER16_2_enter_DefaultMode_from_RESET();
+  INTERRUPT_0_enter_DefaultMode_from_RESET();
+  USBLIB_0_enter_DefaultMode_from_RESET();
+  SFRPAGE = sfrPage;
+  // Wake the CPU when a switch changes
+  P0MASK = SWITCH_MASK;
+  P0MAT = P0;
+  EIE1 |= EIE1_EMAT__ENABLED;
+}
+
+// Stops the workflow of a switch if it is running or paused
+void abortWorkflow(uint8_t index)
+{
+  ENGINE_LOCK();
+  runnerIndex = index;
+  runner = &runners[index];
+  if (runner->state == RUNNER_RUNNING || runner->state == RUNNER_PAUSED)
+    setRunnerState(RUNNER_ABORTING);
+  ENGINE_UNLOCK();
 }
 
 void astrokeyPoll()
 {
-  if (PRESSED(S0) && PRESSED(S4))
+  SI_VARIABLE_SEGMENT_POINTER(staged, StagedWorkflow_TypeDef, SI_SEG_XDATA);
+#if !WORKFLOW_STEP_IN_SOF
+  uint8_t queuedReports;
+#endif
+
+  // Anything that happens from here on wakes the next pass
+  mainLoopWake = false;
+
+  // Switches are sampled and debounced by the timer 2 interrupt
+  if ((debouncedSwitches & RESET_SWITCHES) == RESET_SWITCHES)
   {
     *((uint8_t SI_SEG_DATA *) 0x00) = 0xA5;
     RSTSRC = RSTSRC_SWRSF__SET | RSTSRC_PORSF__SET;
   }
-  // Workflow currently running
-  if (workflowIndex != NO_WORKFLOW)
+
+  // Start saving the oldest staged upload, stopping the old copy if it is running
+  if (!stagingSaving && stagingTail != stagingHead)
   {
-    if (keyReportSent)
-      stepWorkflow();
+    staged = &stagingQueue[stagingTail & STAGING_QUEUE_MASK];
+
+    if (staged->index < NUM_SWITCHES)
+      abortWorkflow(staged->index);
+
+    startSave(staged->workflow, staged->length, staged->index);
+    stagingSaving = true;
+    mainLoopWake = true;
   }
-  // No workflow running, scan switches
-  else
+
+  // Carry out one page erase or write burst of the save in progress
+  // Moving stored workflows waits for every stored workflow to stop reading
+  // flash, streamed actions are played from RAM
+  if (saveBusy() && !workflowReading
+      && !(saveCompacting() && (runningWorkflows & ~bitMasks[STREAM_RUNNER]) != 0))
   {
-    if (workflowUpdated != -1)
-    {
-      saveWorkflow(tmpWorkflow, workflowUpdated);
-      workflowUpdated = -1;
-    }
+    saveStep();
+    mainLoopWake = true;
+  }
 
-    if (checkKeyPressed(1 << 0, PRESSED(S0)))
-      startWorkflow(0);
-    else if (checkKeyReleased(1 << 0, PRESSED(S0)))
-      resumeWorkflow(0);
+  // The save reads the staged upload, so its slot is freed once it finishes
+  // This runs before switch edges are handled, so a workflow started from the
+  // old record during the save is stopped before a release can resume it in
+  // the new one
+  if (stagingSaving && !saveBusy())
+  {
+    staged = &stagingQueue[stagingTail & STAGING_QUEUE_MASK];
+    if (saveStatus.status == SAVE_STATUS_DONE)
+      abortWorkflow(staged->index);
+
+    // The host reads both together in the upload fence
+    USB_DisableInts();
+    uploadFailures = (uploadFailures << 1) | (saveStatus.status != SAVE_STATUS_DONE);
+    stagingTail++;
+    USB_EnableInts();
+    stagingSaving = false;
+    mainLoopWake = true;
+  }
 
-    else if (checkKeyPressed(1 << 1, PRESSED(S1)))
-      startWorkflow(1);
-    else if (checkKeyReleased(1 << 1, PRESSED(S1)))
-      resumeWorkflow(1);
+  // Tell the host which keys are down in the protocol it selected
+  if (protocolChanged)
+  {
+    ENGINE_LOCK();
+    if (!REPORT_QUEUE_FULL())
+    {
+      protocolChanged = false;
+      rebuildReport();
+      queueReport();
+    }
+    ENGINE_UNLOCK();
+  }
 
-    else if (checkKeyPressed(1 << 2, PRESSED(S2)))
-      startWorkflow(2);
-    else if (checkKeyReleased(1 << 2, PRESSED(S2)))
-      resumeWorkflow(2);
+  // Switch edges wait while stored workflows are being moved
+  if (!saveCompacting())
+    handleSwitchEvents();
 
-    else if (checkKeyPressed(1 << 3, PRESSED(S3)))
-      startWorkflow(3);
-    else if (checkKeyReleased(1 << 3, PRESSED(S3)))
-      resumeWorkflow(3);
+#if !WORKFLOW_STEP_IN_SOF
+  if (runningWorkflows != 0 && !REPORT_QUEUE_FULL())
+  {
+    queuedReports = reportHead;
+    stepWorkflow();
+    // Keep building reports ahead while the workflows are making progress
+    if (reportHead != queuedReports)
+      mainLoopWake = true;
+  }
+#endif
+}
 
-    else if (checkKeyPressed(1 << 4, PRESSED(S4)))
-      startWorkflow(4);
-    else if (checkKeyReleased(1 << 4, PRESSED(S4)))
-      resumeWorkflow(4);
+// Puts the CPU in idle mode until an interrupt has work for the main loop
+void astrokeySleep()
+{
+  IE_EA = 0;
+  while (!mainLoopWake)
+  {
+    // The instruction after enabling interrupts always runs first, so an
+    // interrupt arriving from here on wakes the CPU from idle
+    IE_EA = 1;
+    PCON0 |= PCON0_IDLE__IDLE;
+    PCON0 = PCON0;
+    IE_EA = 0;
   }
+  IE_EA = 1;
 }
@@ -0,0 +1,239 @@
+//-----------------------------------------------------------------------------
+// batch.c
+//-----------------------------------------------------------------------------
+// Copyright 2018 AstroKey
+// https://github.com/AstroKey/astrokey_firmware/blob/master/LICENSE
+//
+// File Description:
+//
+// Implementation of batches of vendor requests carried over EP0. Both
+// functions are called from the USB interrupt, with the batch in tmpWorkflow.
+//
+
+#include <string.h>
+#include "astrokey.h"
+#include "storage.h"
+#include "delay.h"
+#include "debounce.h"
+#include "batch.h"
+
+// ----------------------------------------------------------------------------
+// Variables
+// ----------------------------------------------------------------------------
+// Commands of the last batch, answered when the answers are read
+BatchCommand_TypeDef SI_SEG_XDATA batchCommands[BATCH_MAX_COMMANDS];
+uint8_t batchCount = 0;
+
+// Stores a little endian value in an answer
+void putLe16(uint8_t* bytes, uint16_t value)
+{
+  bytes[0] = value & 0xFF;
+  bytes[1] = value >> 8;
+}
+
+// Stages an upload carried in a batch
+// Returns false if the staging queue has no free slot
+bool batchUpload(uint8_t index, uint8_t* bytes, uint16_t length)
+{
+  SI_VARIABLE_SEGMENT_POINTER(staged, StagedWorkflow_TypeDef, SI_SEG_XDATA);
+
+  if (STAGING_QUEUE_FULL() || stagingReceiving)
+    return false;
+
+  staged = &stagingQueue[stagingHead & STAGING_QUEUE_MASK];
+  staged->index = index;
+  staged->length = length;
+  memcpy(staged->workflow, bytes, length);
+  stagingHead++;
+  mainLoopWake = true;
+  return true;
+}
+
+// Carries out the commands that change settings and uploads, and keeps
+// every command to answer later
+void batchReceived(uint16_t length)
+{
+  uint16_t offset = 0;
+  uint16_t payloadLength;
+  SI_VARIABLE_SEGMENT_POINTER(command, BatchCommand_TypeDef, SI_SEG_XDATA);
+
+  batchCount = 0;
+  while (length - offset >= sizeof(BatchHeader_TypeDef) && batchCount < BATCH_MAX_COMMANDS)
+  {
+    command = &batchCommands[batchCount++];
+    command->request = tmpWorkflow[offset];
+    command->value = tmpWorkflow[offset + 1] | ((uint16_t)tmpWorkflow[offset + 2] << 8);
+    command->refused = false;
+    payloadLength = tmpWorkflow[offset + 3] | ((uint16_t)tmpWorkflow[offset + 4] << 8);
+    offset += sizeof(BatchHeader_TypeDef);
+
+    // A command cut off by the end of the batch ends it
+    if (payloadLength > length - offset)
+    {
+      command->refused = true;
+      break;
+    }
+
+    switch (command->request)
+    {
+      case ASTROKEY_SET_WORKFLOW:
+        if (command->value < NUM_SWITCHES
+            && batchUpload(command->value, tmpWorkflow + offset, payloadLength))
+          command->value = stagingHead;
+        else
+          command->refused = true;
+        break;
+      case ASTROKEY_SET_DEBOUNCE:
+        if (payloadLength != 0 || !setDebounce(command->value))
+          command->refused = true;
+        break;
+      case ASTROKEY_SET_POLICY:
+        if (command->value < NUM_WORKFLOW_POLICIES && payloadLength == 0)
+          workflowPolicy = command->value;
+        else
+          command->refused = true;
+        break;
+      case ASTROKEY_GET_WORKFLOW:
+      case ASTROKEY_GET_POLICY:
+      case ASTROKEY_GET_DEBOUNCE:
+      case ASTROKEY_GET_SAVE_STATUS:
+      case ASTROKEY_GET_UPLOAD_FENCE:
+      case ASTROKEY_GET_WORKFLOW_CRCS:
+      case ASTROKEY_GET_STREAM:
+      case 0xF0:
+      case 0xF1:
+        command->refused = (payloadLength != 0);
+        break;
+      default:
+        command->refused = true;
+        break;
+    }
+
+    offset += payloadLength;
+  }
+}
+
+// Bytes in the answer to a command, answers to GET_WORKFLOW are cut to room
+uint8_t answerLength(SI_VARIABLE_SEGMENT_POINTER(command, BatchCommand_TypeDef, SI_SEG_XDATA), uint8_t room)
+{
+  uint16_t length;
+
+  switch (command->request)
+  {
+    case ASTROKEY_SET_WORKFLOW:
+    case ASTROKEY_GET_POLICY:
+      return 1;
+    case ASTROKEY_GET_DEBOUNCE:
+      return 2;
+    case ASTROKEY_GET_SAVE_STATUS:
+      return sizeof(SaveStatus_TypeDef);
+    case ASTROKEY_GET_UPLOAD_FENCE:
+      return sizeof(UploadFence_TypeDef);
+    case ASTROKEY_GET_WORKFLOW_CRCS:
+      return 2 * NUM_SWITCHES;
+    case ASTROKEY_GET_STREAM:
+      return sizeof(StreamStatus_TypeDef);
+    case 0xF0:
+      return sizeof(uint32_t);
+    case 0xF1:
+      return sizeof(lastSwitchEvent);
+    case ASTROKEY_GET_WORKFLOW:
+      length = workflowLength(command->value & 0xFF);
+      if (length <= (command->value >> 8))
+        return 0;
+      length -= command->value >> 8;
+      return (length < room) ? length : room;
+  }
+  return 0;
+}
+
+// Writes the answer to a command
+void answerCommand(SI_VARIABLE_SEGMENT_POINTER(command, BatchCommand_TypeDef, SI_SEG_XDATA), uint8_t* answer, uint8_t length)
+{
+  uint8_t i;
+  uint32_t millis;
+
+  switch (command->request)
+  {
+    case ASTROKEY_SET_WORKFLOW:
+      answer[0] = command->value;
+      break;
+    case ASTROKEY_GET_POLICY:
+      answer[0] = workflowPolicy;
+      break;
+    case ASTROKEY_GET_DEBOUNCE:
+      putLe16(answer, debounceMode | ((uint16_t)debounceWindow << 8));
+      break;
+    case ASTROKEY_GET_SAVE_STATUS:
+      answer[0] = saveStatus.status;
+      answer[1] = saveStatus.index;
+      putLe16(answer + 2, saveStatus.written);
+      putLe16(answer + 4, saveStatus.length);
+      break;
+    case ASTROKEY_GET_UPLOAD_FENCE:
+      answer[0] = stagingHead;
+      answer[1] = stagingTail;
+      answer[2] = uploadFailures;
+      break;
+    case ASTROKEY_GET_WORKFLOW_CRCS:
+      for (i = 0; i < NUM_SWITCHES; i++)
+        putLe16(answer + 2 * i, workflowCrc(i));
+      break;
+    case ASTROKEY_GET_STREAM:
+      putLe16(answer, streamPlayed());
+      putLe16(answer + 2, streamHead);
+      break;
+    case 0xF0:
+      millis = getMillis();
+      memcpy(answer, &millis, sizeof(millis));
+      break;
+    case 0xF1:
+      memcpy(answer, &lastSwitchEvent, sizeof(lastSwitchEvent));
+      break;
+    case ASTROKEY_GET_WORKFLOW:
+      readWorkflow(answer, command->value & 0xFF, command->value >> 8, length);
+      break;
+  }
+}
+
+// Builds the answers to the last batch in tmpWorkflow
+// Returns the number of bytes of answers
+uint16_t batchReply()
+{
+  uint8_t i;
+  uint8_t length;
+  uint8_t room;
+  uint16_t replyLength = 0;
+  SI_VARIABLE_SEGMENT_POINTER(command, BatchCommand_TypeDef, SI_SEG_XDATA);
+
+  for (i = 0; i < batchCount; i++)
+  {
+    if (WORKFLOW_MAX_BYTES - replyLength < sizeof(BatchAnswer_TypeDef))
+      break;
+    command = &batchCommands[i];
+    room = WORKFLOW_MAX_BYTES - replyLength - sizeof(BatchAnswer_TypeDef);
+
+    // Stored workflows move while they are saved, so reading them and their
+    // CRCs is refused like the vendor requests
+    if (command->refused
+        || (saveBusy() && (command->request == ASTROKEY_GET_WORKFLOW
+                           || command->request == ASTROKEY_GET_WORKFLOW_CRCS)))
+    {
+      length = BATCH_REFUSED;
+    }
+    else
+    {
+      length = answerLength(command, room);
+      if (length > room)
+        break;
+      answerCommand(command, tmpWorkflow + replyLength + sizeof(BatchAnswer_TypeDef), length);
+    }
+
+    tmpWorkflow[replyLength] = command->request;
+    tmpWorkflow[replyLength + 1] = length;
+    replyLength += sizeof(BatchAnswer_TypeDef);
+    if (length != BATCH_REFUSED)
+      replyLength += length;
+  }
+  return replyLength;
+}
@@ -0,0 +1,371 @@
+//-----------------------------------------------------------------------------
+// bulk.c
+//-----------------------------------------------------------------------------
+// Copyright 2018 AstroKey
+// https://github.com/AstroKey/astrokey_firmware/blob/master/LICENSE
+//
+// File Description:
+//
+// Implementation of the framed workflow transport on the WebUSB bulk endpoints.
+//
+
+#include <endian.h>
+#include "SI_EFM8UB1_Register_Enums.h"
+#include "efm8_usb.h"
+#include "usb_0.h"
+#include "descriptors.h"
+#include "astrokey.h"
+#include "storage.h"
+#include "bulk.h"
+
+// ----------------------------------------------------------------------------
+// Variables
+// ----------------------------------------------------------------------------
+// Last packet received from the host and packet of answers being built
+uint8_t SI_SEG_XDATA bulkOutBuffer[BULK_PACKET_SIZE];
+uint8_t SI_SEG_XDATA bulkInBuffer[BULK_PACKET_SIZE];
+
+// Bytes in the last packet received, valid once bulkOutReady is set
+volatile uint8_t bulkOutLength;
+volatile bool bulkOutReady = false;
+// Set while a packet of answers is being sent
+volatile bool bulkInBusy = false;
+// Set when the device is configured and the transport starts over
+volatile bool bulkRestartPending = false;
+
+volatile bool bulkOwnsBuffer = false;
+
+// Bytes of the last packet received already taken
+uint8_t bulkOutOffset;
+// Bytes of answers in bulkInBuffer
+uint8_t bulkInLength = 0;
+
+// Step the transport is at
+uint8_t bulkState = BULK_STATE_HEADER;
+
+// Frame being received and answer being sent
+BulkFrame_TypeDef SI_SEG_XDATA bulkFrame;
+BulkFrame_TypeDef SI_SEG_XDATA bulkReply;
+// Bytes of the frame or answer part in progress handled so far
+uint16_t SI_SEG_XDATA frameOffset = 0;
+// Payload of the answer being sent
+SI_SEGMENT_VARIABLE(replyData, uint8_t*, SI_SEG_XDATA);
+uint16_t SI_SEG_XDATA replyLength;
+// Ticket sent in answer to SET_WORKFLOW and fence sent in answer to END
+uint8_t replyTicket;
+UploadFence_TypeDef SI_SEG_XDATA replyFence;
+// Stream status sent in answer to STREAM
+StreamStatus_TypeDef SI_SEG_XDATA replyStream;
+// Set while the bulk transport is receiving into the staging queue
+bool bulkStaging = false;
+
+// Next and last switch to answer a GET_WORKFLOW frame with
+uint8_t loadIndex;
+uint8_t loadLast;
+
+// Starts the transport over, called from the USB interrupt once configured
+void bulkRestart()
+{
+  bulkRestartPending = true;
+  mainLoopWake = true;
+}
+
+// Takes a packet received from the host, called from the USB interrupt
+void bulkReceived(uint16_t length)
+{
+  bulkOutLength = length;
+  bulkOutReady = true;
+  mainLoopWake = true;
+}
+
+// Frees the packet of answers, called from the USB interrupt once sent
+void bulkSent()
+{
+  bulkInBusy = false;
+  mainLoopWake = true;
+}
+
+// Waits for the next packet from the host
+void receivePacket()
+{
+  bulkOutReady = false;
+  bulkOutOffset = 0;
+  USB_DisableInts();
+  USBD_Read(BULK_OUT_EP_ADDR, bulkOutBuffer, BULK_PACKET_SIZE, true);
+  USB_EnableInts();
+}
+
+// Sends the answers in bulkInBuffer
+void sendPacket()
+{
+  bulkInBusy = true;
+  USB_DisableInts();
+  USBD_Write(BULK_IN_EP_ADDR, bulkInBuffer, bulkInLength, true);
+  USB_EnableInts();
+  bulkInLength = 0;
+}
+
+// Takes bytes from the host, receiving more packets as they are used up
+// Bytes may be NULL to discard them
+// Returns true once length bytes are taken
+bool receiveBytes(uint8_t* bytes, uint16_t length)
+{
+  while (frameOffset < length)
+  {
+    if (!bulkOutReady)
+      return false;
+    if (bulkOutOffset == bulkOutLength)
+    {
+      receivePacket();
+      return false;
+    }
+    if (bytes != NULL)
+      bytes[frameOffset] = bulkOutBuffer[bulkOutOffset];
+    bulkOutOffset++;
+    frameOffset++;
+  }
+  frameOffset = 0;
+  return true;
+}
+
+// Takes streamed actions from the host while the ring has room
+// Returns true once length bytes are taken
+bool receiveStream(uint16_t length)
+{
+  while (frameOffset < length)
+  {
+    if (!bulkOutReady || streamCredits() == 0)
+      return false;
+    if (bulkOutOffset == bulkOutLength)
+    {
+      receivePacket();
+      return false;
+    }
+    streamAppend(bulkOutBuffer[bulkOutOffset]);
+    bulkOutOffset++;
+    frameOffset++;
+  }
+  frameOffset = 0;
+  return true;
+}
+
+// Adds answer bytes to bulkInBuffer, sending it whenever it fills
+// Returns true once length bytes are added
+bool sendBytes(uint8_t* bytes, uint16_t length)
+{
+  while (frameOffset < length)
+  {
+    if (bulkInBusy)
+      return false;
+    bulkInBuffer[bulkInLength++] = bytes[frameOffset++];
+    if (bulkInLength == BULK_PACKET_SIZE)
+      sendPacket();
+  }
+  frameOffset = 0;
+  return true;
+}
+
+// Takes the staging slot at stagingHead unless the queue is full or an
+// upload on EP0 is being received
+bool claimStaging()
+{
+  USB_DisableInts();
+  if (!STAGING_QUEUE_FULL() && !stagingReceiving)
+  {
+    stagingReceiving = true;
+    bulkStaging = true;
+  }
+  USB_EnableInts();
+  return bulkStaging;
+}
+
+// Takes the workflow buffer unless a transfer on EP0 is using it, which
+// holds off transfers on EP0 that need it
+bool claimBuffer()
+{
+  USB_DisableInts();
+  if (!bufferOnEP0)
+    bulkOwnsBuffer = true;
+  USB_EnableInts();
+  return bulkOwnsBuffer;
+}
+
+// Starts sending an answer
+void startReply(uint8_t command, uint8_t index, uint8_t* bytes, uint16_t length)
+{
+  bulkReply.command = command;
+  bulkReply.index = index;
+  bulkReply.length = htole16(length);
+  replyData = bytes;
+  replyLength = length;
+  bulkState = BULK_STATE_REPLY;
+}
+
+// Checks a received frame header and starts handling the frame
+void startFrame()
+{
+  bulkFrame.length = le16toh(bulkFrame.length);
+
+  if (bulkFrame.command == BULK_CMD_END && bulkFrame.length == 0)
+  {
+    bulkState = BULK_STATE_SAVE;
+  }
+  else if (bulkFrame.command == BULK_CMD_SET_WORKFLOW
+           && bulkFrame.index < NUM_SWITCHES
+           && bulkFrame.length <= WORKFLOW_MAX_BYTES)
+  {
+    bulkState = BULK_STATE_CLAIM;
+  }
+  else if (bulkFrame.command == BULK_CMD_GET_WORKFLOW
+           && (bulkFrame.index < NUM_SWITCHES || bulkFrame.index == BULK_ALL_WORKFLOWS)
+           && bulkFrame.length == 0)
+  {
+    loadIndex = (bulkFrame.index == BULK_ALL_WORKFLOWS) ? 0 : bulkFrame.index;
+    loadLast = (bulkFrame.index == BULK_ALL_WORKFLOWS) ? NUM_SWITCHES - 1 : bulkFrame.index;
+    bulkState = BULK_STATE_SAVE;
+  }
+  else if (bulkFrame.command == BULK_CMD_STREAM
+           && (bulkFrame.index == BULK_STREAM_APPEND || bulkFrame.index == BULK_STREAM_RESET))
+  {
+    if (bulkFrame.index == BULK_STREAM_RESET)
+      streamReset();
+    bulkState = BULK_STATE_STREAM;
+  }
+  else
+  {
+    bulkState = BULK_STATE_SKIP;
+  }
+}
+
+// Carries the bulk transport as far as it can go without waiting
+void bulkPoll()
+{
+  if (bulkRestartPending)
+  {
+    bulkRestartPending = false;
+    bulkOwnsBuffer = false;
+    // The host starts its stream over too
+    streamReset();
+    if (bulkStaging)
+    {
+      bulkStaging = false;
+      stagingReceiving = false;
+    }
+    bulkInBusy = false;
+    bulkInLength = 0;
+    frameOffset = 0;
+    bulkState = BULK_STATE_HEADER;
+    receivePacket();
+  }
+
+  while (1)
+  {
+    switch (bulkState)
+    {
+      case BULK_STATE_HEADER:
+        if (!receiveBytes((uint8_t*) &bulkFrame, sizeof(bulkFrame)))
+          return;
+        startFrame();
+        break;
+
+      case BULK_STATE_CLAIM:
+        if (!claimStaging())
+          return;
+        bulkState = BULK_STATE_PAYLOAD;
+        break;
+
+      case BULK_STATE_PAYLOAD:
+        if (!receiveBytes(stagingQueue[stagingHead & STAGING_QUEUE_MASK].workflow, bulkFrame.length))
+          return;
+        // Saved by the main loop like an upload on EP0
+        stagingQueue[stagingHead & STAGING_QUEUE_MASK].index = bulkFrame.index;
+        stagingQueue[stagingHead & STAGING_QUEUE_MASK].length = bulkFrame.length;
+        stagingHead++;
+        stagingReceiving = false;
+        bulkStaging = false;
+        mainLoopWake = true;
+        replyTicket = stagingHead;
+        startReply(BULK_CMD_SET_WORKFLOW, bulkFrame.index, &replyTicket, 1);
+        break;
+
+      case BULK_STATE_SAVE:
+        // Answers reflect every upload staged before the frame
+        if (stagingTail != stagingHead || stagingReceiving)
+          return;
+        if (bulkFrame.command == BULK_CMD_GET_WORKFLOW)
+        {
+          if (!claimBuffer())
+            return;
+          bulkState = BULK_STATE_LOAD;
+          break;
+        }
+        replyFence.received = stagingHead;
+        replyFence.completed = stagingTail;
+        replyFence.failures = uploadFailures;
+        startReply(BULK_CMD_END, 0, (uint8_t*) &replyFence, sizeof(replyFence));
+        break;
+
+      case BULK_STATE_SKIP:
+        if (!receiveBytes(NULL, bulkFrame.length))
+          return;
+        startReply(BULK_CMD_ERROR, bulkFrame.index, NULL, 0);
+        break;
+
+      case BULK_STATE_LOAD:
+        if (loadIndex > loadLast)
+        {
+          bulkOwnsBuffer = false;
+          bulkState = BULK_STATE_HEADER;
+          break;
+        }
+        startReply(BULK_CMD_GET_WORKFLOW, loadIndex, tmpWorkflow, loadWorkflow(tmpWorkflow, loadIndex));
+        loadIndex++;
+        break;
+
+      case BULK_STATE_REPLY:
+        if (!sendBytes((uint8_t*) &bulkReply, sizeof(bulkReply)))
+          return;
+        bulkState = BULK_STATE_DATA;
+        break;
+
+      case BULK_STATE_DATA:
+        if (!sendBytes(replyData, replyLength))
+          return;
+        // Stream status is sent straight away so the host can send more
+        if (bulkReply.command == BULK_CMD_END || bulkReply.command == BULK_CMD_STREAM)
+          bulkState = BULK_STATE_FLUSH;
+        else if (bulkReply.command == BULK_CMD_GET_WORKFLOW)
+          bulkState = BULK_STATE_LOAD;
+        else
+          bulkState = BULK_STATE_HEADER;
+        break;
+
+      case BULK_STATE_STREAM:
+        if (!receiveStream(bulkFrame.length))
+          return;
+        bulkState = BULK_STATE_CREDITS;
+        break;
+
+      case BULK_STATE_CREDITS:
+        // The answer waits for room for another frame, unless the stream
+        // has stopped and the ring will not drain any further
+        if (streamCredits() < STREAM_RING_SIZE / 2 && STREAM_RUNNING())
+          return;
+        ENGINE_LOCK();
+        replyStream.played = htole16(streamPlayed());
+        replyStream.received = htole16(streamHead);
+        ENGINE_UNLOCK();
+        startReply(BULK_CMD_STREAM, bulkFrame.index, (uint8_t*) &replyStream, sizeof(replyStream));
+        break;
+
+      case BULK_STATE_FLUSH:
+        // The answers to a batch end in a short packet, which is empty if
+        // the last answer filled a packet
+        if (bulkInBusy)
+          return;
+        sendPacket();
+        bulkState = BULK_STATE_HEADER;
+        break;
+    }
+  }
+}
@@ -10,12 +10,18 @@
 //
 
 #include "SI_EFM8UB1_Register_Enums.h"
+#include <endian.h>
 #include "efm8_usb.h"
 #include "descriptors.h"
 #include "idle.h"
 #include "webusb.h"
 #include "astrokey.h"
+#include "storage.h"
 #include "delay.h"
+#include "report.h"
+#include "debounce.h"
+#include "bulk.h"
+#include "batch.h"
 
 // ----------------------------------------------------------------------------
 // Constants
@@ -25,13 +31,35 @@
 // Variables
 // ----------------------------------------------------------------------------
 uint8_t tmpBuffer;
-volatile int8_t workflowTransfer = -1;
-
+uint8_t tmpOffset;
+// Set while an upload on EP0 is being received into the staging queue
+bool stagingOnEP0 = false;
+volatile bool workflowReading = false;
+// Set while a batch on EP0 is being received into tmpWorkflow
+bool batchOnEP0 = false;
+volatile bool bufferOnEP0 = false;
+
+uint16_t tmp16;
+SaveStatus_TypeDef SI_SEG_XDATA tmpSaveStatus;
+UploadFence_TypeDef SI_SEG_XDATA tmpUploadFence;
+StreamStatus_TypeDef SI_SEG_XDATA tmpStreamStatus;
+uint16_t SI_SEG_XDATA tmpCrcs[NUM_SWITCHES];
 uint32_t tmp32;
 
 // ----------------------------------------------------------------------------
 // Functions
 // ----------------------------------------------------------------------------
+// Selects the report protocol, the main loop rebuilds the key report for it
+void setProtocol(uint8_t protocol)
+{
+  if (keyReportProtocol != protocol)
+  {
+    keyReportProtocol = protocol;
+    protocolChanged = true;
+    mainLoopWake = true;
+  }
+}
+
 #if SLAB_USB_HANDLER_CB
 void USBD_EnterHandler(void)
 {
@@ -47,32 +75,28 @@ void USBD_ExitHandler(void)
 #if SLAB_USB_RESET_CB
 void USBD_ResetCb(void)
 {
-
+  // Devices start in report protocol after a reset, a BIOS may have left it
+  // in boot protocol
+  setProtocol(HID_PROTOCOL_REPORT);
 }
 #endif // SLAB_USB_RESET_CB
 
 #if SLAB_USB_SOF_CB
 void USBD_SofCb(uint16_t sofNr)
 {
-  int8_t status;
   UNREFERENCED_ARGUMENT(sofNr);
 
   idleTimerTick();
 
-  // Check if the device should send a report
-  // if (isIdleTimerExpired() == true || !keyReportSent)
-  if (!keyReportSent)
-  {
-    status = USBD_Write(KEYBOARD_IN_EP_ADDR,
-                        (SI_VARIABLE_SEGMENT_POINTER(, uint8_t, SI_SEG_GENERIC))&keyReport,
-                        sizeof(KeyReport_TypeDef),
-                        false);
-    if (status == USB_STATUS_OK)
-      keyReportSent = true;
-  }
-
-
+#if WORKFLOW_STEP_IN_SOF
+  // Advance the running workflows by one report
+  if (runningWorkflows != 0 && !REPORT_QUEUE_FULL())
+    stepWorkflow();
+#endif
 
+  // Reports are normally sent as soon as they are queued or the previous one
+  // completes, this catches any that could not be sent at the time
+  sendQueuedReport();
 }
 #endif // SLAB_USB_SOF_CB
 
@@ -92,10 +116,17 @@ void USBD_DeviceStateChangeCb(USBD_State_TypeDef oldState,
 
     // Abort any pending transfer
     USBD_AbortTransfer(KEYBOARD_IN_EP_ADDR);
+
+    // Any switch change wakes the device from suspend
+    P0MAT = P0;
   }
   else if (newState == USBD_STATE_CONFIGURED)
   {
+    // SET_CONFIGURATION starts over in report protocol, a resume keeps it
+    if (oldState == USBD_STATE_ADDRESSED)
+      setProtocol(HID_PROTOCOL_REPORT);
     idleSetDuration(POLL_RATE_MS);
+    bulkRestart();
   }
 
   // Exiting suspend mode, power internal and external blocks up
@@ -113,6 +144,28 @@ bool USBD_IsSelfPoweredCb(void)
 }
 #endif // SLAB_USB_IS_SELF_POWERED_CB
 
+// Ends the transfer on EP0, completed is false if it was cut short
+// A failed upload leaves its slot free for the retry
+void endControlTransfer(bool completed, uint16_t length)
+{
+  if (stagingOnEP0)
+  {
+    if (completed)
+      stagingHead++;
+    stagingReceiving = false;
+    stagingOnEP0 = false;
+  }
+  if (batchOnEP0)
+  {
+    if (completed)
+      batchReceived(length);
+    batchOnEP0 = false;
+  }
+  bufferOnEP0 = false;
+  workflowReading = false;
+  mainLoopWake = true;
+}
+
 #if SLAB_USB_SETUP_CMD_CB
 USB_Status_TypeDef USBD_SetupCmdCb(SI_VARIABLE_SEGMENT_POINTER(
                                      setup,
@@ -121,6 +174,9 @@ USB_Status_TypeDef USBD_SetupCmdCb(SI_VARIABLE_SEGMENT_POINTER(
 {
   USB_Status_TypeDef retVal = USB_STATUS_REQ_UNHANDLED;
 
+  // A setup command ends the last transfer on EP0 even if it was cut short
+  endControlTransfer(false, 0);
+
   // Setup Command: Standard request to device in direction IN
   if ((setup->bmRequestType.Type == USB_SETUP_TYPE_STANDARD)
       && (setup->bmRequestType.Direction == USB_SETUP_DIR_IN)
@@ -201,15 +257,121 @@ USB_Status_TypeDef USBD_SetupCmdCb(SI_VARIABLE_SEGMENT_POINTER(
       case ASTROKEY_BREQUEST:
         switch (setup->wIndex)
         {
-          // Read workflow off device
+          // Read workflow off device, the index is in the low byte of wValue
+          // and the offset to start reading at in the high byte
           case ASTROKEY_GET_WORKFLOW:
-            loadWorkflow(tmpWorkflow, setup->wValue);
+            // Stored workflows move while they are saved
+            if (saveBusy())
+              break;
+
+            tmpBuffer = setup->wValue & 0xFF;
+            tmpOffset = setup->wValue >> 8;
+            tmp16 = workflowLength(tmpBuffer);
+            tmp16 = (tmp16 > tmpOffset) ? EFM8_MIN(tmp16 - tmpOffset, setup->wLength) : 0;
 
+            if (tmp16 == 0)
+            {
+              USBD_Write(EP0, &tmpBuffer, 0, false);
+            }
+            else if (tmp16 <= workflowSpan(tmpBuffer, tmpOffset))
+            {
+              // Sent straight from flash
+              workflowReading = true;
+              USBD_Write(EP0,
+                         (SI_VARIABLE_SEGMENT_POINTER(, uint8_t, SI_SEG_GENERIC))
+                         (SI_VARIABLE_SEGMENT_POINTER(, uint8_t, SI_SEG_CODE))workflowAddress(tmpBuffer, tmpOffset),
+                         tmp16,
+                         true);
+            }
+            else
+            {
+              // Records that wrap around the end of user flash are copied
+              if (bulkOwnsBuffer)
+                break;
+              bufferOnEP0 = true;
+              loadWorkflow(tmpWorkflow, tmpBuffer);
+              USBD_Write(EP0,
+                         (SI_VARIABLE_SEGMENT_POINTER(, uint8_t, SI_SEG_GENERIC))(tmpWorkflow + tmpOffset),
+                         tmp16,
+                         true);
+            }
+
+            retVal = USB_STATUS_OK;
+            break;
+          // Read workflow policy
+          case ASTROKEY_GET_POLICY:
+            tmpBuffer = workflowPolicy;
+            USBD_Write(EP0, &tmpBuffer, EFM8_MIN(1, setup->wLength), false);
+            retVal = USB_STATUS_OK;
+            break;
+          // Read progress of the last save
+          case ASTROKEY_GET_SAVE_STATUS:
+            tmpSaveStatus.status = saveStatus.status;
+            tmpSaveStatus.index = saveStatus.index;
+            tmpSaveStatus.written = htole16(saveStatus.written);
+            tmpSaveStatus.length = htole16(saveStatus.length);
             USBD_Write(EP0,
-                       (SI_VARIABLE_SEGMENT_POINTER(, uint8_t, SI_SEG_GENERIC))tmpWorkflow,
-                       EFM8_MIN(WORKFLOW_BYTES, setup->wLength),
+                       (SI_VARIABLE_SEGMENT_POINTER(, uint8_t, SI_SEG_GENERIC))&tmpSaveStatus,
+                       EFM8_MIN(sizeof(tmpSaveStatus), setup->wLength),
+                       false);
+            retVal = USB_STATUS_OK;
+            break;
+          // Read the CRC of each stored workflow, so the host only transfers
+          // the workflows that differ from its copy
+          case ASTROKEY_GET_WORKFLOW_CRCS:
+            // The CRCs change when a save is committed
+            if (saveBusy())
+              break;
+
+            for (tmpBuffer = 0; tmpBuffer < NUM_SWITCHES; tmpBuffer++)
+              tmpCrcs[tmpBuffer] = htole16(workflowCrc(tmpBuffer));
+            USBD_Write(EP0,
+                       (SI_VARIABLE_SEGMENT_POINTER(, uint8_t, SI_SEG_GENERIC))tmpCrcs,
+                       EFM8_MIN(sizeof(tmpCrcs), setup->wLength),
                        false);
+            retVal = USB_STATUS_OK;
+            break;
+          // Read the answers to the last batch
+          case ASTROKEY_BATCH:
+            if (bulkOwnsBuffer)
+              break;
 
+            bufferOnEP0 = true;
+            tmp16 = batchReply();
+            USBD_Write(EP0,
+                       (SI_VARIABLE_SEGMENT_POINTER(, uint8_t, SI_SEG_GENERIC))tmpWorkflow,
+                       EFM8_MIN(tmp16, setup->wLength),
+                       true);
+            retVal = USB_STATUS_OK;
+            break;
+          // Read how much of the stream is played and received
+          case ASTROKEY_GET_STREAM:
+            tmpStreamStatus.played = htole16(streamPlayed());
+            tmpStreamStatus.received = htole16(streamHead);
+            USBD_Write(EP0,
+                       (SI_VARIABLE_SEGMENT_POINTER(, uint8_t, SI_SEG_GENERIC))&tmpStreamStatus,
+                       EFM8_MIN(sizeof(tmpStreamStatus), setup->wLength),
+                       false);
+            retVal = USB_STATUS_OK;
+            break;
+          // Read which uploads are received and finished
+          case ASTROKEY_GET_UPLOAD_FENCE:
+            tmpUploadFence.received = stagingHead;
+            tmpUploadFence.completed = stagingTail;
+            tmpUploadFence.failures = uploadFailures;
+            USBD_Write(EP0,
+                       (SI_VARIABLE_SEGMENT_POINTER(, uint8_t, SI_SEG_GENERIC))&tmpUploadFence,
+                       EFM8_MIN(sizeof(tmpUploadFence), setup->wLength),
+                       false);
+            retVal = USB_STATUS_OK;
+            break;
+          // Read debounce mode and window
+          case ASTROKEY_GET_DEBOUNCE:
+            tmp16 = htole16(debounceMode | ((uint16_t)debounceWindow << 8));
+            USBD_Write(EP0,
+                       (SI_VARIABLE_SEGMENT_POINTER(, uint8_t, SI_SEG_GENERIC))&tmp16,
+                       EFM8_MIN(sizeof(tmp16), setup->wLength),
+                       false);
             retVal = USB_STATUS_OK;
             break;
           case 0xF0:
@@ -223,6 +385,16 @@ USB_Status_TypeDef USBD_SetupCmdCb(SI_VARIABLE_SEGMENT_POINTER(
 
             retVal = USB_STATUS_OK;
 
+            break;
+          case 0xF1:
+
+            USBD_Write(EP0,
+                       (SI_VARIABLE_SEGMENT_POINTER(, uint8_t, SI_SEG_GENERIC))&lastSwitchEvent,
+                       EFM8_MIN(sizeof(lastSwitchEvent), setup->wLength),
+                       false);
+
+            retVal = USB_STATUS_OK;
+
             break;
         }
         break;
@@ -240,16 +412,50 @@ USB_Status_TypeDef USBD_SetupCmdCb(SI_VARIABLE_SEGMENT_POINTER(
       switch (setup->wIndex) // Request type
       {
         case ASTROKEY_SET_WORKFLOW:
-          memset((void*) tmpWorkflow, 0, WORKFLOW_BYTES);
+          if (setup->wValue >= NUM_SWITCHES)
+            break;
+          // The host retries once a staged upload is saved
+          if (STAGING_QUEUE_FULL() || stagingReceiving)
+            break;
+
+          stagingReceiving = true;
+          stagingOnEP0 = true;
+          stagingQueue[stagingHead & STAGING_QUEUE_MASK].index = setup->wValue;
+          stagingQueue[stagingHead & STAGING_QUEUE_MASK].length = EFM8_MIN(WORKFLOW_MAX_BYTES, setup->wLength);
           USBD_Read(EP0,
-                    (SI_VARIABLE_SEGMENT_POINTER(, uint8_t, SI_SEG_GENERIC))tmpWorkflow,
-                    EFM8_MIN(WORKFLOW_BYTES, setup->wLength),
+                    (SI_VARIABLE_SEGMENT_POINTER(, uint8_t, SI_SEG_GENERIC))stagingQueue[stagingHead & STAGING_QUEUE_MASK].workflow,
+                    stagingQueue[stagingHead & STAGING_QUEUE_MASK].length,
                     true);
 
-          workflowTransfer = setup->wValue;
+          retVal = USB_STATUS_OK;
+          break;
+        // Carry out a batch of commands, answered by ASTROKEY_BATCH IN
+        case ASTROKEY_BATCH:
+          if (bulkOwnsBuffer || setup->wLength > WORKFLOW_MAX_BYTES)
+            break;
+
+          bufferOnEP0 = true;
+          batchOnEP0 = true;
+          USBD_Read(EP0,
+                    (SI_VARIABLE_SEGMENT_POINTER(, uint8_t, SI_SEG_GENERIC))tmpWorkflow,
+                    setup->wLength,
+                    true);
 
           retVal = USB_STATUS_OK;
           break;
+        // Select debounce mode in the low byte and window in the high byte
+        case ASTROKEY_SET_DEBOUNCE:
+          if (setup->wLength == 0 && setDebounce(setup->wValue))
+            retVal = USB_STATUS_OK;
+          break;
+        // Select what happens when switches are pressed during a workflow
+        case ASTROKEY_SET_POLICY:
+          if (setup->wValue < NUM_WORKFLOW_POLICIES && setup->wLength == 0)
+          {
+            workflowPolicy = setup->wValue;
+            retVal = USB_STATUS_OK;
+          }
+          break;
       }
     }
   }
@@ -286,7 +492,7 @@ USB_Status_TypeDef USBD_SetupCmdCb(SI_VARIABLE_SEGMENT_POINTER(
           {
             case HID_KEYBOARD_IFC: // HID Interface
               USBD_Write(EP0,
-                         (SI_VARIABLE_SEGMENT_POINTER(, uint8_t, SI_SEG_GENERIC))(&configDesc[27]),
+                         (SI_VARIABLE_SEGMENT_POINTER(, uint8_t, SI_SEG_GENERIC))(&configDesc[HID_DESC_OFFSET]),
                          EFM8_MIN(USB_HID_DESCSIZE, setup->wLength),
                          false);
               retVal = USB_STATUS_OK;
@@ -322,14 +528,13 @@ USB_Status_TypeDef USBD_SetupCmdCb(SI_VARIABLE_SEGMENT_POINTER(
       case USB_HID_GET_REPORT:
         if (((setup->wValue >> 8) == 1)               // Input report
             && ((setup->wValue & 0xFF) == 0)          // Report ID
-            && (setup->wLength == 8)                  // Report length
+            && (setup->wLength == KEY_REPORT_LENGTH()) // Report length
             && (setup->bmRequestType.Direction == USB_SETUP_DIR_IN))
         {
           USBD_Write(KEYBOARD_IN_EP_ADDR,
                      (SI_VARIABLE_SEGMENT_POINTER(, uint8_t, SI_SEG_GENERIC))&keyReport,
-                     sizeof(KeyReport_TypeDef),
+                     KEY_REPORT_LENGTH(),
                      false);
-          keyReportSent = true;
 
           retVal = USB_STATUS_OK;
         }
@@ -345,6 +550,27 @@ USB_Status_TypeDef USBD_SetupCmdCb(SI_VARIABLE_SEGMENT_POINTER(
         }
         break;
 
+      case USB_HID_SET_PROTOCOL:
+        if ((setup->wValue <= HID_PROTOCOL_REPORT)    // Boot or report protocol
+            && (setup->wLength == 0)
+            && (setup->bmRequestType.Direction != USB_SETUP_DIR_IN))
+        {
+          setProtocol(setup->wValue);
+          retVal = USB_STATUS_OK;
+        }
+        break;
+
+      case USB_HID_GET_PROTOCOL:
+        if ((setup->wValue == 0)
+            && (setup->wLength == 1)
+            && (setup->bmRequestType.Direction == USB_SETUP_DIR_IN))
+        {
+          tmpBuffer = keyReportProtocol;
+          USBD_Write(EP0, &tmpBuffer, 1, false);
+          retVal = USB_STATUS_OK;
+        }
+        break;
+
       case USB_HID_GET_IDLE:
         if ((setup->wValue == 0)                      // Report ID
             && (setup->wLength == 1)
@@ -380,13 +606,24 @@ bool USBD_RemoteWakeupCb(void)
   // Return true if a remote wakeup event was the cause of the device
   // exiting suspend mode.
   // Otherwise return false
-  return false;
+  uint8_t pressed = SWITCHES_PRESSED();
+
+  // Wait for the next switch change
+  P0MAT = P0;
+
+  if (pressed == 0)
+    return false;
+
+  // The workflows of these switches start once the bus resumes
+  wakeupSwitches |= pressed;
+  mainLoopWake = true;
+  return true;
 }
 
 void USBD_RemoteWakeupDelay(void)
 {
   // Delay 10 - 15 ms here
-
+  delayBlocking(12);
 }
 #endif
 
@@ -395,17 +632,27 @@ uint16_t USBD_XferCompleteCb(uint8_t epAddr,
                              uint16_t xferred,
                              uint16_t remaining)
 {
-  UNREFERENCED_ARGUMENT(epAddr);
   UNREFERENCED_ARGUMENT(xferred);
   UNREFERENCED_ARGUMENT(remaining);
 
-  if (status == USB_STATUS_OK)
+  if (epAddr == KEYBOARD_IN_EP_ADDR)
   {
-    if (workflowTransfer != -1)
-    {
-      workflowUpdated = workflowTransfer;
-      workflowTransfer = -1;
-    }
+    // Send the next queued report
+    reportSent(status == USB_STATUS_OK);
+  }
+  else if (epAddr == BULK_OUT_EP_ADDR)
+  {
+    // Failed reads are restarted once the device is configured again
+    if (status == USB_STATUS_OK)
+      bulkReceived(xferred);
+  }
+  else if (epAddr == BULK_IN_EP_ADDR)
+  {
+    bulkSent();
+  }
+  else
+  {
+    endControlTransfer(status == USB_STATUS_OK, xferred);
   }
 
   return 0;
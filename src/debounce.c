@@ -0,0 +1,144 @@
+//-----------------------------------------------------------------------------
+// debounce.c
+//-----------------------------------------------------------------------------
+// Copyright 2018 AstroKey
+// https://github.com/AstroKey/astrokey_firmware/blob/master/LICENSE
+//
+// File Description:
+//
+// Implementation of switch debouncing.
+//
+
+#include "SI_EFM8UB1_Register_Enums.h"
+#include "astrokey.h"
+#include "debounce.h"
+
+// ----------------------------------------------------------------------------
+// Variables
+// ----------------------------------------------------------------------------
+volatile uint8_t debouncedSwitches = 0;
+
+volatile uint8_t debounceMode = DEBOUNCE_EAGER;
+volatile uint8_t debounceWindow = DEBOUNCE_DEFAULT_WINDOW;
+
+// Mode and window the counters were set up for
+uint8_t counterMode = DEBOUNCE_EAGER;
+uint8_t counterWindow = DEBOUNCE_DEFAULT_WINDOW;
+
+// Per switch counter, in eager mode the milliseconds left before the switch
+// is read again, in integrator mode the milliseconds the switch has read pressed
+uint8_t SI_SEG_XDATA debounceCounters[NUM_SWITCHES] = {0};
+
+// Edges waiting for the main loop, oldest first
+SwitchEvent_TypeDef SI_SEG_XDATA switchEvents[SWITCH_QUEUE_SIZE];
+// The timer interrupt only writes switchEventHead and the main loop only
+// writes switchEventTail, so the queue needs no locking
+volatile uint8_t switchEventHead = 0;
+volatile uint8_t switchEventTail = 0;
+volatile bool switchEventsDropped = false;
+
+volatile uint8_t wakeupSwitches = 0;
+
+// Queues an edge of a switch
+void pushSwitchEvent(uint8_t event, uint16_t time)
+{
+  mainLoopWake = true;
+  if ((uint8_t)(switchEventHead - switchEventTail) == SWITCH_QUEUE_SIZE)
+  {
+    switchEventsDropped = true;
+    return;
+  }
+  switchEvents[switchEventHead & SWITCH_QUEUE_MASK].event = event;
+  switchEvents[switchEventHead & SWITCH_QUEUE_MASK].time = time;
+  // Only publish the event once it is completely written
+  switchEventHead++;
+}
+
+// Takes the oldest edge off the queue, returns false if there is none
+bool popSwitchEvent(SwitchEvent_TypeDef* event)
+{
+  if (switchEventHead == switchEventTail)
+    return false;
+  event->event = switchEvents[switchEventTail & SWITCH_QUEUE_MASK].event;
+  event->time = switchEvents[switchEventTail & SWITCH_QUEUE_MASK].time;
+  switchEventTail++;
+  return true;
+}
+
+// Selects the debounce mode from the low byte and the window from the high byte
+// Returns false if the mode or window is not supported
+bool setDebounce(uint16_t value)
+{
+  if ((value & 0xFF) >= NUM_DEBOUNCE_MODES || (value >> 8) < DEBOUNCE_MIN_WINDOW)
+    return false;
+  debounceMode = value & 0xFF;
+  debounceWindow = value >> 8;
+  return true;
+}
+
+// Samples the switches and queues their debounced edges, called every
+// millisecond from the timer 2 interrupt
+void debounceTick(uint16_t time)
+{
+  uint8_t i;
+  uint8_t bitMask;
+  uint8_t pressed = SWITCHES_PRESSED();
+  uint8_t lastSwitches = debouncedSwitches;
+
+  // Start the counters over if the host changed the settings
+  if (counterMode != debounceMode || counterWindow != debounceWindow)
+  {
+    counterMode = debounceMode;
+    counterWindow = debounceWindow;
+    for (i = 0; i < NUM_SWITCHES; i++)
+    {
+      if (counterMode == DEBOUNCE_INTEGRATOR && (debouncedSwitches & (1 << i)))
+        debounceCounters[i] = counterWindow;
+      else
+        debounceCounters[i] = 0;
+    }
+  }
+
+  for (i = 0, bitMask = 0x01; i < NUM_SWITCHES; i++, bitMask <<= 1)
+  {
+    if (counterMode == DEBOUNCE_EAGER)
+    {
+      if (debounceCounters[i] > 0)
+      {
+        debounceCounters[i]--;
+      }
+      else if ((pressed ^ debouncedSwitches) & bitMask)
+      {
+        debouncedSwitches ^= bitMask;
+        debounceCounters[i] = counterWindow;
+      }
+    }
+    else
+    {
+      if (pressed & bitMask)
+      {
+        if (debounceCounters[i] < counterWindow)
+          debounceCounters[i]++;
+      }
+      else if (debounceCounters[i] > 0)
+      {
+        debounceCounters[i]--;
+      }
+
+      if (debounceCounters[i] == counterWindow)
+        debouncedSwitches |= bitMask;
+      else if (debounceCounters[i] == 0)
+        debouncedSwitches &= ~bitMask;
+    }
+
+    if ((debouncedSwitches ^ lastSwitches) & bitMask)
+      pushSwitchEvent((debouncedSwitches & bitMask) ? (SWITCH_EVENT_PRESSED | i) : i, time);
+  }
+}
+
+// Wakes the CPU when a switch changes, the edge is debounced by the next timer tick
+SI_INTERRUPT(portMatchISR, PMATCH_IRQn)
+{
+  // Match the current level so the interrupt fires on the next change
+  P0MAT = P0;
+}
@@ -11,6 +11,8 @@
 
 #include "SI_EFM8UB1_Register_Enums.h"
 #include "delay.h"
+#include "debounce.h"
+#include "astrokey.h"
 
 static volatile uint32_t millis = 0;
 
@@ -24,10 +26,32 @@ void resetMillis()
   millis = 0;
 }
 
+// Waits for a number of milliseconds while the timer 2 interrupt cannot run,
+// such as from the USB interrupt
+void delayBlocking(uint8_t delay)
+{
+  while (delay > 0)
+  {
+    if (TMR2CN0 & TMR2CN0_TF2H__SET)
+    {
+      TMR2CN0 &= ~(TMR2CN0_TF2H__SET | TMR2CN0_TF2L__SET);
+      millis++;
+      delay--;
+    }
+  }
+}
+
 SI_INTERRUPT(timer2ISR, TIMER2_IRQn)
 {
   // Increment millisecond counter
   millis++;
+  // Sample the switches
+  debounceTick((uint16_t)millis);
+#if !WORKFLOW_STEP_IN_SOF
+  // Running workflows check their delays every millisecond
+  if (runningWorkflows != 0)
+    mainLoopWake = true;
+#endif
   // Clear interrupt flag
   TMR2CN0 &= ~(TMR2CN0_TF2H__SET | TMR2CN0_TF2L__SET);
 }
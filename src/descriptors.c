@@ -24,7 +24,10 @@ extern "C" {
 
 
 // HID Report Descriptor for Interface 0
-SI_SEGMENT_VARIABLE(ReportDescriptor0[69],
+// In report protocol the 6 boot key slots are padding and keys are reported
+// through the N-key-rollover bitmap, in boot protocol only the first 8 bytes
+// of the report are sent.
+SI_SEGMENT_VARIABLE(ReportDescriptor0[75],
                     const uint8_t,
                     SI_SEG_CODE) =
 {
@@ -45,13 +48,16 @@ SI_SEGMENT_VARIABLE(ReportDescriptor0[69],
   0x75, 0x01,                      // REPORT_SIZE (1)      // Reserved
   0x95, 0x08,                      // REPORT_COUNT (8)     // Reserved
   0x81, 0x01,                      // INPUT (Cnst,Ary,Abs) // Reserved
-  0x19, 0x00,                      // USAGE_MINIMUM (Reserved (no event indicated))  // Keys
-  0x29, 0x65,                      // USAGE_MAXIMUM (Keyboard Application)           // Keys
-  0x15, 0x00,                      // LOGICAL_MINIMUM (0)                            // Keys
-  0x25, 0x65,                      // LOGICAL_MAXIMUM (101)                          // Keys
-  0x75, 0x08,                      // REPORT_SIZE (8)                                // Keys
-  0x95, 0x06,                      // REPORT_COUNT (6)                               // Keys
-  0x81, 0x00,                      // INPUT (Data,Ary,Abs)                           // Keys
+  0x75, 0x08,                      // REPORT_SIZE (8)      // Boot keys
+  0x95, 0x06,                      // REPORT_COUNT (6)     // Boot keys
+  0x81, 0x01,                      // INPUT (Cnst,Ary,Abs) // Boot keys
+  0x19, 0x00,                      // USAGE_MINIMUM (Reserved (no event indicated))  // Key bitmap
+  0x29, 0xdf,                      // USAGE_MAXIMUM (Usage 223)                      // Key bitmap
+  0x15, 0x00,                      // LOGICAL_MINIMUM (0)                            // Key bitmap
+  0x25, 0x01,                      // LOGICAL_MAXIMUM (1)                            // Key bitmap
+  0x75, 0x01,                      // REPORT_SIZE (1)                                // Key bitmap
+  0x95, 0xe0,                      // REPORT_COUNT (224)                             // Key bitmap
+  0x81, 0x02,                      // INPUT (Data,Var,Abs)                           // Key bitmap
   0x05, 0x08,                      // USAGE_PAGE (LEDs)           // LEDs
   0x19, 0x01,                      // USAGE_MINIMUM (Num Lock)    // LEDs
   0x29, 0x03,                      // USAGE_MAXIMUM (Scroll Lock) // LEDs
@@ -95,13 +101,14 @@ SI_SEGMENT_VARIABLE(configDesc[],
 {
   USB_CONFIG_DESCSIZE,             // bLength
   USB_CONFIG_DESCRIPTOR,           // bDescriptorType
-  0x2B,                            // wTotalLength(LSB)
+  0x39,                            // wTotalLength(LSB)
   0x00,                            // wTotalLength(MSB)
   2,                               // bNumInterfaces
   1,                               // bConfigurationValue
   0,                               // iConfiguration
 
-  CONFIG_DESC_BM_RESERVED_D7,      // bmAttrib: Bus-powered
+  CONFIG_DESC_BM_RESERVED_D7       // bmAttrib: Bus-powered,
+  | CONFIG_DESC_BM_REMOTEWAKEUP,   // remote wakeup
 
   CONFIG_DESC_MAXPOWER_mA(500),    // bMaxPower: 100 mA
 
@@ -110,12 +117,30 @@ SI_SEGMENT_VARIABLE(configDesc[],
   USB_INTERFACE_DESCRIPTOR,        // bDescriptorType
   0,                               // bInterfaceNumber
   0,                               // bAlternateSetting
-  0,                               // bNumEndpoints
+  2,                               // bNumEndpoints
   0xFF,                            // bInterfaceClass: Vendor Specific
   0,                               // bInterfaceSubClass
   0,                               // bInterfaceProtocol
   0,                               // iInterface
 
+  //Endpoint 2 OUT Descriptor
+  USB_ENDPOINT_DESCSIZE,           // bLength
+  USB_ENDPOINT_DESCRIPTOR,         // bDescriptorType
+  USB_EP_DIR_OUT | 2,              // bEndpointAddress
+  USB_EPTYPE_BULK,                 // bAttrib
+  0x40,                            // wMaxPacketSize (LSB)
+  0x00,                            // wMaxPacketSize (MSB)
+  0,                               // bInterval
+
+  //Endpoint 2 IN Descriptor
+  USB_ENDPOINT_DESCSIZE,           // bLength
+  USB_ENDPOINT_DESCRIPTOR,         // bDescriptorType
+  USB_EP_DIR_IN | 2,               // bEndpointAddress
+  USB_EPTYPE_BULK,                 // bAttrib
+  0x40,                            // wMaxPacketSize (LSB)
+  0x00,                            // wMaxPacketSize (MSB)
+  0,                               // bInterval
+
   //Interface 1 Descriptor
   USB_INTERFACE_DESCSIZE,          // bLength
   USB_INTERFACE_DESCRIPTOR,        // bDescriptorType
@@ -123,7 +148,7 @@ SI_SEGMENT_VARIABLE(configDesc[],
   0,                               // bAlternateSetting
   1,                               // bNumEndpoints
   3,                               // bInterfaceClass: HID (Human Interface Device)
-  0,                               // bInterfaceSubClass (0 = not bootable)
+  1,                               // bInterfaceSubClass (1 = boot interface)
   1,                               // bInterfaceProtocol (1 = keyboard)
   0,                               // iInterface
 
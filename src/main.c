@@ -17,6 +17,7 @@
 // The main source code file for the AstroKey firmware.
 //
 #include "astrokey.h"
+#include "bulk.h"
 
 #include <stdint.h>
 
@@ -34,5 +35,7 @@ int16_t main(void)
   while (1)
   {
     astrokeyPoll();
+    bulkPoll();
+    astrokeySleep();
   }
 }
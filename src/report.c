@@ -0,0 +1,76 @@
+//-----------------------------------------------------------------------------
+// report.c
+//-----------------------------------------------------------------------------
+// Copyright 2018 AstroKey
+// https://github.com/AstroKey/astrokey_firmware/blob/master/LICENSE
+//
+// File Description:
+//
+// Implementation of the queue of keyboard reports waiting to be sent.
+//
+
+#include <string.h>
+#include "SI_EFM8UB1_Register_Enums.h"
+#include "efm8_usb.h"
+#include "usb_0.h"
+#include "descriptors.h"
+#include "report.h"
+#include "astrokey.h"
+
+// ----------------------------------------------------------------------------
+// Variables
+// ----------------------------------------------------------------------------
+// Reports built by the workflow engine, oldest first
+KeyReport_TypeDef SI_SEG_XDATA reportQueue[REPORT_QUEUE_SIZE];
+
+// Count of reports queued by the main loop
+volatile uint8_t reportHead = 0;
+// Count of reports sent to the host
+volatile uint8_t reportTail = 0;
+
+// Whether the report at reportTail is being sent
+bool reportInFlight = false;
+
+// Copies the current key state to the end of the queue
+// Must only be called from the main loop when the queue is not full
+void queueReport()
+{
+  memcpy(&reportQueue[reportHead & REPORT_QUEUE_MASK],
+         (KeyReport_TypeDef SI_SEG_XDATA *) &keyReport,
+         sizeof(KeyReport_TypeDef));
+  // Only publish the slot once it is completely written
+  reportHead++;
+
+  // Send the report now if the endpoint is idle rather than at the next SOF
+  USB_DisableInts();
+  sendQueuedReport();
+  USB_EnableInts();
+}
+
+// Starts sending the oldest queued report if the endpoint is free
+// Must not be interrupted by the USB interrupt
+void sendQueuedReport()
+{
+  if (reportInFlight || reportHead == reportTail)
+    return;
+
+  if (USBD_Write(KEYBOARD_IN_EP_ADDR,
+                 (SI_VARIABLE_SEGMENT_POINTER(, uint8_t, SI_SEG_GENERIC))
+                   &reportQueue[reportTail & REPORT_QUEUE_MASK],
+                 KEY_REPORT_LENGTH(),
+                 true) == USB_STATUS_OK)
+    reportInFlight = true;
+}
+
+// Frees the slot of a report once the host has read it and chains the next report
+// Called from the transfer complete callback of the keyboard endpoint
+void reportSent(bool received)
+{
+  reportInFlight = false;
+  // A report that was aborted is sent again
+  if (received)
+    reportTail++;
+  // The engine can build another report
+  mainLoopWake = true;
+  sendQueuedReport();
+}
@@ -0,0 +1,613 @@
+//-----------------------------------------------------------------------------
+// storage.c
+//-----------------------------------------------------------------------------
+// Copyright 2018 AstroKey
+// https://github.com/AstroKey/astrokey_firmware/blob/master/LICENSE
+//
+// File Description:
+//
+// Implementation of workflow storage in user data flash.
+//
+
+#include <stddef.h>
+#include <string.h>
+#include "SI_EFM8UB1_Register_Enums.h"
+#include "storage.h"
+#include "EFM8UB1_FlashPrimitives.h"
+#include "EFM8UB1_FlashUtils.h"
+
+// ----------------------------------------------------------------------------
+// Variables
+// ----------------------------------------------------------------------------
+// Newest record of each switch, NO_PAGE if it has none
+WorkflowRecord_TypeDef SI_SEG_XDATA records[NUM_SWITCHES];
+
+// Oldest page of the log and the page the next record starts at
+uint8_t logTail;
+uint8_t logHead;
+// Pages from the tail of the log to its head
+uint8_t logPages;
+// Sequence number of the next record
+uint16_t SI_SEG_XDATA nextSequence;
+
+// Header being read or written
+RecordHeader_TypeDef SI_SEG_XDATA header;
+
+// Progress of the last save, read by the host
+volatile SaveStatus_TypeDef SI_SEG_XDATA saveStatus = {SAVE_STATUS_IDLE, 0, 0, 0};
+
+// Step the save in progress is at
+uint8_t saveState = SAVE_STATE_IDLE;
+// Workflow being saved
+SI_SEGMENT_VARIABLE(saveData, uint8_t*, SI_SEG_XDATA);
+// Pages taken by the new record
+uint8_t saveNumPages;
+// Page of the new record being erased
+uint8_t savePage;
+// CRC of the workflow being saved
+uint16_t SI_SEG_XDATA saveCrc;
+// Free pages kept after the save, enough to move the largest live record
+uint8_t saveReserve;
+
+// Pages left to copy of the live record being moved from the tail of the
+// log, the switch it belongs to and the page it is being moved to
+uint8_t movePagesLeft = 0;
+uint8_t moveIndex;
+uint8_t moveFirstPage;
+// Page of the record being copied
+uint8_t movePage;
+
+// Page following a page of the log
+#define NEXT_PAGE(page) (((page) + 1) % USER_NUM_PAGES)
+
+// Flash address of a byte of a record, wrapping to the start of user flash
+FLADDR recordAddress(uint8_t page, uint16_t offset)
+{
+  FLADDR address = PAGE_ADDR(page) + offset;
+  if (address >= USER_END_ADDR)
+    address -= USER_NUM_BYTES;
+  return address;
+}
+
+// Writes bytes of a record, splitting the write where the record wraps
+void writeRecord(uint8_t page, uint16_t offset, uint8_t* bytes, uint16_t length)
+{
+  FLADDR address = recordAddress(page, offset);
+  uint16_t part = USER_END_ADDR - address;
+
+  if (part > length)
+    part = length;
+  FLASH_WriteDiff(address, bytes, part);
+  if (part < length)
+    FLASH_WriteDiff(USER_START_ADDR, bytes + part, length - part);
+}
+
+// Reads bytes of a record, splitting the read where the record wraps
+void readRecord(uint8_t* bytes, uint8_t page, uint16_t offset, uint16_t length)
+{
+  FLADDR address = recordAddress(page, offset);
+  uint16_t part = USER_END_ADDR - address;
+
+  if (part > length)
+    part = length;
+  FLASH_Read(bytes, address, part);
+  if (part < length)
+    FLASH_Read(bytes + part, USER_START_ADDR, length - part);
+}
+
+// Checks if the workflow stored in a record matches bytes in RAM
+bool recordMatches(uint8_t page, uint8_t* bytes, uint16_t length)
+{
+  FLADDR address = recordAddress(page, sizeof(RecordHeader_TypeDef));
+  uint16_t part = USER_END_ADDR - address;
+
+  if (part > length)
+    part = length;
+  return FLASH_Compare(address, bytes, part)
+         && FLASH_Compare(USER_START_ADDR, bytes + part, length - part);
+}
+
+// Starts a CRC-16/CCITT on the CRC0 unit, bytes are added by writing CRC0IN
+// Only the main loop uses CRC0, one CRC at a time
+void crcStart()
+{
+  CRC0CN0 = CRC0CN0_CRCINIT__INIT | CRC0CN0_CRCVAL__SET_ONES;
+}
+
+// Reads the CRC of the bytes added since crcStart
+uint16_t crcResult()
+{
+  uint16_t crc;
+
+  CRC0CN0 = CRC0CN0_CRCPNT__ACCESS_UPPER;
+  crc = (uint16_t)CRC0DAT << 8;
+  CRC0CN0 = CRC0CN0_CRCPNT__ACCESS_LOWER;
+  return crc | CRC0DAT;
+}
+
+// Adds bytes of flash to the CRC, reading them like FLASH_Read
+void crcFlash(FLADDR address, uint16_t length)
+{
+  SI_VARIABLE_SEGMENT_POINTER(pread, uint8_t, const SI_SEG_CODE);
+
+  pread = (SI_VARIABLE_SEGMENT_POINTER(, uint8_t, const SI_SEG_CODE)) address;
+  for (; length; length--)
+    CRC0IN = *pread++;
+}
+
+// CRC of the workflow stored in a record
+uint16_t recordCrc(uint8_t page, uint16_t length)
+{
+  FLADDR address = recordAddress(page, sizeof(RecordHeader_TypeDef));
+  uint16_t part = USER_END_ADDR - address;
+
+  if (part > length)
+    part = length;
+  crcStart();
+  crcFlash(address, part);
+  crcFlash(USER_START_ADDR, length - part);
+  return crcResult();
+}
+
+// Reads the header at the start of a page
+// Returns true if the page starts a record
+bool readHeader(uint8_t page)
+{
+  FLASH_Read((uint8_t*) &header, PAGE_ADDR(page), sizeof(header));
+  return header.magic == RECORD_MAGIC
+         && header.index < NUM_SWITCHES
+         && header.length <= WORKFLOW_MAX_BYTES;
+}
+
+// Checks if a page starts a committed record whose workflow matches its CRC
+bool recordValid(uint8_t page)
+{
+  return readHeader(page)
+         && header.commit == RECORD_COMMITTED
+         && recordCrc(page, header.length) == header.crc;
+}
+
+// Writes a header to the start of a page, then commits it with a single byte
+// write once the rest of the record is in place
+void writeHeader(uint8_t page)
+{
+  header.magic = RECORD_MAGIC;
+  header.commit = 0xFF;
+  FLASH_Write(PAGE_ADDR(page), (uint8_t*) &header, sizeof(header));
+}
+
+void commitRecord(uint8_t page)
+{
+  FLASH_ByteWrite(PAGE_ADDR(page) + offsetof(RecordHeader_TypeDef, commit), RECORD_COMMITTED);
+}
+
+// Erases a page unless it is already erased
+void erasePage(uint8_t page)
+{
+  if (!FLASH_Blank(PAGE_ADDR(page), USER_PAGE_SIZE))
+    FLASH_PageErase(PAGE_ADDR(page));
+}
+
+// Checks if a page of the new record can be written without erasing it
+// The header has to be erased and the workflow may only clear bits
+bool recordPageProgrammable(uint8_t index)
+{
+  uint8_t page = (logHead + index) % USER_NUM_PAGES;
+  uint16_t pageStart = (uint16_t)index * USER_PAGE_SIZE;
+  uint16_t start = pageStart;
+  uint16_t end = pageStart + USER_PAGE_SIZE;
+
+  if (index == 0)
+  {
+    if (!FLASH_Blank(PAGE_ADDR(page), sizeof(RecordHeader_TypeDef)))
+      return false;
+    start = sizeof(RecordHeader_TypeDef);
+  }
+  if (end > sizeof(RecordHeader_TypeDef) + saveStatus.length)
+    end = sizeof(RecordHeader_TypeDef) + saveStatus.length;
+
+  return start >= end
+         || FLASH_Programmable(PAGE_ADDR(page) + (start - pageStart),
+                               saveData + (start - sizeof(RecordHeader_TypeDef)),
+                               end - start);
+}
+
+// Finds the switch whose newest record starts at a page
+// Returns NO_WORKFLOW if the page holds no live record
+uint8_t liveRecordAt(uint8_t page)
+{
+  uint8_t i;
+  for (i = 0; i < NUM_SWITCHES; i++)
+  {
+    if (records[i].page == page && records[i].length > 0)
+      return i;
+  }
+  return NO_WORKFLOW;
+}
+
+// Counts the valid records following a record with consecutive sequence
+// numbers, including the record itself
+uint8_t chainLength(uint16_t validPages, uint8_t page)
+{
+  uint8_t count = 0;
+  uint8_t pages = 0;
+  uint16_t sequence = 0;
+
+  while ((validPages & (1U << page))
+         && readHeader(page)
+         && (count == 0 || header.sequence == sequence))
+  {
+    pages += RECORD_PAGES(header.length);
+    if (pages > USER_NUM_PAGES)
+      break;
+    count++;
+    sequence = header.sequence + 1;
+    page = (page + RECORD_PAGES(header.length)) % USER_NUM_PAGES;
+  }
+  return count;
+}
+
+// Moves workflows from the fixed layout of earlier firmware into the log
+// Each record is written over pages whose workflows are already moved
+void migrateLegacy()
+{
+  uint8_t i;
+  uint16_t length;
+
+  logTail = NUM_SWITCHES * LEGACY_WORKFLOW_PAGES;
+  logHead = logTail;
+
+  for (i = 0; i < NUM_SWITCHES; i++)
+  {
+    length = LEGACY_WORKFLOW_PAGES * USER_PAGE_SIZE;
+    FLASH_Read(tmpWorkflow, PAGE_ADDR(i * LEGACY_WORKFLOW_PAGES), length);
+    while (length > 0 && tmpWorkflow[length - 1] == WORKFLOW_ACTION_UNPROGRAMMED)
+      length--;
+
+    if (length > 0 && startSave(tmpWorkflow, length, i))
+    {
+      while (saveBusy())
+        saveStep();
+    }
+  }
+}
+
+// Rebuilds the workflow records from the log in flash
+void storageInit()
+{
+  uint8_t i;
+  uint8_t page;
+  uint8_t count;
+  uint8_t bestCount = 0;
+  uint16_t validPages = 0;
+  bool foundRecord = false;
+
+  for (i = 0; i < NUM_SWITCHES; i++)
+    records[i].page = NO_PAGE;
+  logTail = 0;
+  logHead = 0;
+  logPages = 0;
+  nextSequence = 0;
+
+  for (page = 0; page < USER_NUM_PAGES; page++)
+  {
+    if (recordValid(page))
+      validPages |= 1U << page;
+    else if (header.magic == RECORD_MAGIC)
+      foundRecord = true;
+  }
+
+  // The log is the longest run of valid records with consecutive sequence
+  // numbers, which starts at its tail. A record left uncommitted by power
+  // loss ends the run, so the last committed record of its switch is used.
+  for (page = 0; page < USER_NUM_PAGES; page++)
+  {
+    count = chainLength(validPages, page);
+    if (count > bestCount)
+    {
+      bestCount = count;
+      logTail = page;
+    }
+  }
+
+  if (bestCount == 0)
+  {
+    // Erased flash migrates to an empty log
+    if (!foundRecord)
+      migrateLegacy();
+    return;
+  }
+
+  // Later records of a switch replace earlier ones
+  page = logTail;
+  while (bestCount--)
+  {
+    readHeader(page);
+    records[header.index].page = page;
+    records[header.index].length = header.length;
+    records[header.index].crc = header.crc;
+    nextSequence = header.sequence + 1;
+    logPages += RECORD_PAGES(header.length);
+    page = (page + RECORD_PAGES(header.length)) % USER_NUM_PAGES;
+  }
+  logHead = page;
+}
+
+// Flash address of a byte of a workflow
+FLADDR workflowAddress(uint8_t index, uint16_t offset)
+{
+  return recordAddress(records[index].page, sizeof(RecordHeader_TypeDef) + offset);
+}
+
+// Number of bytes of a workflow from offset on that are stored in one piece,
+// the rest of a record that wraps is at the start of user flash
+uint16_t workflowSpan(uint8_t index, uint16_t offset)
+{
+  uint16_t length = workflowLength(index);
+  uint16_t part;
+
+  if (offset >= length)
+    return 0;
+  length -= offset;
+  part = USER_END_ADDR - workflowAddress(index, offset);
+  return (part < length) ? part : length;
+}
+
+// CRC-16/CCITT of a workflow as of its last save, 0xFFFF if it is empty
+uint16_t workflowCrc(uint8_t index)
+{
+  if (workflowLength(index) == 0)
+    return 0xFFFF;
+  return records[index].crc;
+}
+
+// Number of bytes stored for a workflow, 0 if it is empty
+uint16_t workflowLength(uint8_t index)
+{
+  if (index >= NUM_SWITCHES || records[index].page == NO_PAGE)
+    return 0;
+  return records[index].length;
+}
+
+// Starts saving a workflow, the save is carried out by saveStep
+// The old copy of the workflow is dropped straight away
+// Returns false if there is not enough free space
+bool startSave(uint8_t* workflowData, uint16_t length, uint8_t saveIndex)
+{
+  uint8_t i;
+  uint8_t pages;
+  uint8_t livePages = 0;
+  uint8_t maxPages = RECORD_PAGES(length);
+  uint16_t offset;
+
+  saveStatus.index = saveIndex;
+  saveStatus.length = length;
+  saveStatus.written = 0;
+
+  if (saveIndex >= NUM_SWITCHES || length > WORKFLOW_MAX_BYTES)
+  {
+    saveStatus.status = SAVE_STATUS_FAILED;
+    return false;
+  }
+
+  // Saving the workflow that is already stored leaves flash alone
+  if (workflowLength(saveIndex) == length
+      && (length == 0 || recordMatches(records[saveIndex].page, workflowData, length)))
+  {
+    saveStatus.written = length;
+    saveStatus.status = SAVE_STATUS_DONE;
+    return true;
+  }
+
+  // Enough pages are kept free to move the largest live record whole
+  for (i = 0; i < NUM_SWITCHES; i++)
+  {
+    if (i != saveIndex && records[i].page != NO_PAGE && records[i].length > 0)
+    {
+      pages = RECORD_PAGES(records[i].length);
+      livePages += pages;
+      if (pages > maxPages)
+        maxPages = pages;
+    }
+  }
+
+  // The old record is kept until the new one is committed, so a save cut
+  // short by power loss leaves it in place. A save without room for both is
+  // refused rather than dropping the old record first. Clearing a workflow
+  // drops it straight away, so a full log can always be cleared, as a clear
+  // cut short leaves the switch cleared or as it was.
+  if (length == 0)
+  {
+    records[saveIndex].page = NO_PAGE;
+  }
+  else if (records[saveIndex].page != NO_PAGE && records[saveIndex].length > 0)
+  {
+    pages = RECORD_PAGES(records[saveIndex].length);
+    livePages += pages;
+    if (pages > maxPages)
+      maxPages = pages;
+  }
+  if (livePages + RECORD_PAGES(length) + maxPages > USER_NUM_PAGES)
+  {
+    saveStatus.status = SAVE_STATUS_FAILED;
+    return false;
+  }
+
+  crcStart();
+  for (offset = 0; offset < length; offset++)
+    CRC0IN = workflowData[offset];
+
+  saveData = workflowData;
+  saveCrc = crcResult();
+  saveReserve = maxPages;
+  saveNumPages = RECORD_PAGES(length);
+  savePage = 0;
+  saveStatus.status = SAVE_STATUS_BUSY;
+  saveState = SAVE_STATE_COLLECT;
+  return true;
+}
+
+// Reclaims the page at the tail of the log
+// Superseded records are erased, live records are copied to the head first
+// and the old copy is erased once the new one is committed
+// Returns false if a live record cannot be moved
+bool collectStep()
+{
+  uint8_t i;
+
+  if (movePagesLeft == 0)
+  {
+    moveIndex = liveRecordAt(logTail);
+    if (moveIndex == NO_WORKFLOW)
+    {
+      // Drop an empty workflow once its record is reclaimed
+      for (i = 0; i < NUM_SWITCHES; i++)
+      {
+        if (records[i].page == logTail)
+          records[i].page = NO_PAGE;
+      }
+      erasePage(logTail);
+      logTail = NEXT_PAGE(logTail);
+      logPages--;
+      return true;
+    }
+
+    movePagesLeft = RECORD_PAGES(records[moveIndex].length);
+    if (USER_NUM_PAGES - logPages < movePagesLeft)
+    {
+      movePagesLeft = 0;
+      return false;
+    }
+    moveFirstPage = logHead;
+    movePage = logTail;
+  }
+
+  erasePage(logHead);
+  if (logHead == moveFirstPage)
+  {
+    // The moved record takes the next sequence number
+    readHeader(movePage);
+    FLASH_Copy(PAGE_ADDR(logHead) + sizeof(RecordHeader_TypeDef),
+               PAGE_ADDR(movePage) + sizeof(RecordHeader_TypeDef),
+               USER_PAGE_SIZE - sizeof(RecordHeader_TypeDef));
+    header.sequence = nextSequence;
+    writeHeader(logHead);
+  }
+  else
+  {
+    FLASH_Copy(PAGE_ADDR(logHead), PAGE_ADDR(movePage), USER_PAGE_SIZE);
+  }
+  logHead = NEXT_PAGE(logHead);
+  logPages++;
+  movePage = NEXT_PAGE(movePage);
+
+  if (--movePagesLeft == 0)
+  {
+    commitRecord(moveFirstPage);
+    nextSequence++;
+    records[moveIndex].page = moveFirstPage;
+  }
+  return true;
+}
+
+// Carries out the next page erase or write burst of the save in progress
+void saveStep()
+{
+  uint16_t burst;
+
+  switch (saveState)
+  {
+    case SAVE_STATE_COLLECT:
+      // Collect until the record fits and the largest live record can still be moved
+      if (movePagesLeft == 0 && USER_NUM_PAGES - logPages >= saveNumPages + saveReserve)
+      {
+        saveState = SAVE_STATE_ERASE;
+      }
+      else if (!collectStep())
+      {
+        saveState = SAVE_STATE_IDLE;
+        saveStatus.status = SAVE_STATUS_FAILED;
+      }
+      break;
+
+    case SAVE_STATE_ERASE:
+      // Pages past the head are usually erased already, and pages holding
+      // old data are only erased if the workflow cannot be written over it
+      if (!recordPageProgrammable(savePage))
+        FLASH_PageErase(PAGE_ADDR((logHead + savePage) % USER_NUM_PAGES));
+      savePage++;
+      if (savePage == saveNumPages)
+        saveState = SAVE_STATE_WRITE;
+      break;
+
+    case SAVE_STATE_WRITE:
+      burst = saveStatus.length - saveStatus.written;
+      if (burst > SAVE_BURST_BYTES)
+        burst = SAVE_BURST_BYTES;
+      writeRecord(logHead,
+                  sizeof(RecordHeader_TypeDef) + saveStatus.written,
+                  saveData + saveStatus.written,
+                  burst);
+      saveStatus.written += burst;
+      if (saveStatus.written == saveStatus.length)
+        saveState = SAVE_STATE_COMMIT;
+      break;
+
+    case SAVE_STATE_COMMIT:
+      saveState = SAVE_STATE_IDLE;
+
+      // The workflow is read back before the record is committed, so the host
+      // does not have to verify it
+      if (recordCrc(logHead, saveStatus.length) != saveCrc)
+      {
+        saveStatus.status = SAVE_STATUS_FAILED;
+        break;
+      }
+
+      header.index = saveStatus.index;
+      header.sequence = nextSequence++;
+      header.length = saveStatus.length;
+      header.crc = saveCrc;
+      writeHeader(logHead);
+      commitRecord(logHead);
+
+      records[saveStatus.index].page = logHead;
+      records[saveStatus.index].length = saveStatus.length;
+      records[saveStatus.index].crc = saveCrc;
+      logHead = (logHead + saveNumPages) % USER_NUM_PAGES;
+      logPages += saveNumPages;
+      saveStatus.status = SAVE_STATUS_DONE;
+      break;
+  }
+}
+
+// Checks if a save is in progress
+bool saveBusy()
+{
+  return saveState != SAVE_STATE_IDLE;
+}
+
+// Checks if the save in progress is moving a live record, during which no
+// workflow may read flash
+bool saveCompacting()
+{
+  return saveState == SAVE_STATE_COLLECT
+         && (movePagesLeft > 0 || liveRecordAt(logTail) != NO_WORKFLOW);
+}
+
+// Copies part of a stored workflow into RAM
+void readWorkflow(uint8_t* workflowData, uint8_t index, uint16_t offset, uint16_t length)
+{
+  readRecord(workflowData, records[index].page, sizeof(RecordHeader_TypeDef) + offset, length);
+}
+
+// Copies a workflow into RAM, returns the number of bytes stored for it
+// The rest of the buffer is filled like unprogrammed flash
+uint16_t loadWorkflow(uint8_t* workflowData, uint8_t loadIndex)
+{
+  uint16_t length = workflowLength(loadIndex);
+  if (length > 0)
+    readRecord(workflowData, records[loadIndex].page, sizeof(RecordHeader_TypeDef), length);
+  memset(workflowData + length, WORKFLOW_ACTION_UNPROGRAMMED, WORKFLOW_MAX_BYTES - length);
+  return length;
+}